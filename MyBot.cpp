@@ -1,42 +1,132 @@
+// Per-game state. Host builds (-DHOST) run many games on a pool of
+// worker threads, so there it is per thread and swapped in for each turn
+// (see GameContext).
+#ifdef HOST
+#define GAME_LOCAL thread_local
+#else
+#define GAME_LOCAL
+#endif
+
 #include "pretty_printing.h"
+#include "logging.h"
+#include "arena.h"
 
 #include "hlt.hpp"
 #include "networking.hpp"
 
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <array>
 #include <algorithm>
 #include <iterator>
+#include <numeric>
+#include <cmath>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
 #include <random>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <assert.h>
 
-using namespace std;
-
-ofstream dbg("zzz.log");
+#ifdef HOST
+#include <cerrno>
+#include <cstring>
+#include <queue>
+#include <tuple>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
-#define debug(x) \
-    dbg << #x " = " << (x) << std::endl
-#define debug2(x, y) \
-    dbg << #x " = " << (x) \
-         << ", " #y " = " << (y) << std::endl
-#define debug3(x, y, z) \
-    dbg << #x " = " << (x) \
-         << ", " #y " = " << (y) \
-         << ", " #z " = " << (z) << std::endl
+using namespace std;
 
 bool experiment = false;
 
-int myID;
-int width;
-int height;
-int area;
-vector<int> production;
-vector<int> owner;
-vector<int> strength;
+// Tunable constants, settable as name=value on the command line (see
+// tune.py). Defaults are the hand-picked values.
+struct Params {
+    // Interior pieces move once strength >= this * production.
+    int reinforce_threshold = 6;
+    // Among equally demanded targets, prefer strength closest to this.
+    int reinforce_target = 128;
+    // Weight of the production of a cell we end up owning in diamonds.
+    int production_weight = 1;
+    int production_weight_experiment = 3;
+    // Pieces this close to the other side take part in combat.
+    int combat_radius = 2;
+    int combat_radius_experiment = 3;
+    // Coordinate descent passes in generate_combat_moves and per best
+    // response of the experimental combat solver.
+    int combat_passes = 3;
+    int descent_steps = 3;
+    // The experimental combat solver (see regret_matching()) runs at most
+    // a number of iterations uniform in [min, max]. It stops earlier once
+    // the gap between the two sides' best responses is within
+    // rm_target_gap (strength) per piece, or rm_budget_ms after the frame
+    // arrived.
+    int rm_iterations_min = 20;
+    int rm_iterations_max = 25;
+    int rm_target_gap = 1;
+    int rm_budget_ms = 300;
+    // Percentage of the production potential field (see ProductionField)
+    // added to the value of a cell. Off: no setting tried so far plays
+    // measurably better than 0, so clusters and potential only feed the
+    // log until one does.
+    int potential_percent = 0;
+    // Blocks of the coarse grid that get capture planning each turn.
+    int capture_blocks = 64;
+    // Side of the squares the board planes are stored in (see Layout);
+    // 1 is row-major.
+    int layout_tile = 1;
+} params;
+
+bool set_param(const string &name, int value) {
+    const pair<const char*, int*> table[] = {
+        {"reinforce_threshold", &params.reinforce_threshold},
+        {"reinforce_target", &params.reinforce_target},
+        {"production_weight", &params.production_weight},
+        {"production_weight_experiment",
+            &params.production_weight_experiment},
+        {"combat_radius", &params.combat_radius},
+        {"combat_radius_experiment", &params.combat_radius_experiment},
+        {"combat_passes", &params.combat_passes},
+        {"descent_steps", &params.descent_steps},
+        {"rm_iterations_min", &params.rm_iterations_min},
+        {"rm_iterations_max", &params.rm_iterations_max},
+        {"rm_target_gap", &params.rm_target_gap},
+        {"rm_budget_ms", &params.rm_budget_ms},
+        {"potential_percent", &params.potential_percent},
+        {"capture_blocks", &params.capture_blocks},
+        {"layout_tile", &params.layout_tile},
+    };
+    for (auto kv : table) {
+        if (name == kv.first) {
+            *kv.second = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+GAME_LOCAL int myID;
+GAME_LOCAL int width;
+GAME_LOCAL int height;
+GAME_LOCAL int area;
+GAME_LOCAL vector<int> production;
+GAME_LOCAL vector<int> owner;
+GAME_LOCAL vector<int> strength;
+// Of the current frame to the previous one.
+GAME_LOCAL hlt::FrameDelta frame_delta;
 
 enum class Dir {
     still = 0,
@@ -69,6 +159,71 @@ Dir turn_cw(Dir d) {
     return (Dir)((int)d % 4 + 1);
 }
 
+// Order of the cells in the board planes. The board is cut into squares of
+// side 'tile' (narrower at the right edge, shorter at the bottom), each
+// stored contiguously, squares in row-major order. With tile 1 that is
+// plain row-major, Loc = x + width * y. With larger tiles the radius-2
+// diamonds of the combat code touch one or two squares instead of five
+// rows a board width apart.
+//
+// Either way rows [a, b) are the cells [a * width, b * width) when a and
+// b are multiples of the tile (or the height), which for_row_bands()
+// relies on. Coordinates are looked up rather than divided out, and so are
+// the neighbors with tiles; row-major neighbors are cheaper to compute
+// than to stream from a table on big boards.
+struct Layout {
+    int tile = 0;
+    int board_width = 0;
+    int board_height = 0;
+    vector<int> index;  // [x + width * y]
+    vector<short> xs;
+    vector<short> ys;
+    vector<array<int, 4>> neighbors;  // in the order of all_moves; tiles only
+};
+
+GAME_LOCAL Layout layout;
+
+void init_layout(int tile) {
+    logging::board = {width, height, tile};
+    auto &l = layout;
+    if (l.tile == tile && l.board_width == width &&
+        l.board_height == height)
+        return;
+    assert(tile >= 1);
+    l.tile = tile;
+    l.board_width = width;
+    l.board_height = height;
+    l.index.resize(area);
+    l.xs.resize(area);
+    l.ys.resize(area);
+    for (int y = 0; y < height; y++) {
+        int y0 = y - y % tile;
+        int tile_height = min(tile, height - y0);
+        for (int x = 0; x < width; x++) {
+            int x0 = x - x % tile;
+            int tile_width = min(tile, width - x0);
+            int p = y0 * width + x0 * tile_height +
+                (y - y0) * tile_width + (x - x0);
+            l.index[x + width * y] = p;
+            l.xs[p] = x;
+            l.ys[p] = y;
+        }
+    }
+    l.neighbors.clear();
+    if (tile == 1)
+        return;
+    l.neighbors.resize(area);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            auto &n = l.neighbors[l.index[x + width * y]];
+            n[0] = l.index[x + width * (y == 0 ? height - 1 : y - 1)];
+            n[1] = l.index[(x == width - 1 ? 0 : x + 1) + width * y];
+            n[2] = l.index[x + width * (y == height - 1 ? 0 : y + 1)];
+            n[3] = l.index[(x == 0 ? width - 1 : x - 1) + width * y];
+        }
+    }
+}
+
 class Loc {
 public:
     Loc() = default;
@@ -81,15 +236,18 @@ public:
         return value++;
     }
     static Loc pack(int x, int y) {
-        return x + width * y;
+        assert(x >= 0 && x < width && y >= 0 && y < height);
+        if (layout.tile == 1)
+            return x + width * y;
+        return layout.index[x + width * y];
     }
     int x() const {
         assert(value >= 0 && value < area);
-        return value % width;
+        return layout.xs[value];
     }
     int y() const {
         assert(value >= 0 && value < area);
-        return value / width;
+        return layout.ys[value];
     }
     Loc offset(int dx, int dy) const {
         return pack(
@@ -107,8 +265,19 @@ private:
 };
 
 
+// Log records are formatted on the logger's thread, so the coordinates
+// are worked out from the record's board rather than looked up in layout
+// (see init_layout() for the formula).
 ostream& operator<<(ostream &out, Loc loc) {
-    out << "<" << loc.x() << "," << loc.y() << ">";
+    const auto &b = logging::board_context();
+    int p = loc;
+    int y0 = p / (b.width * b.tile) * b.tile;
+    p -= y0 * b.width;
+    int tile_height = min(b.tile, b.height - y0);
+    int x0 = p / (tile_height * b.tile) * b.tile;
+    p -= x0 * tile_height;
+    int tile_width = min(b.tile, b.width - x0);
+    out << "<" << x0 + p % tile_width << "," << y0 + p / tile_width << ">";
     return out;
 }
 
@@ -123,17 +292,19 @@ int dist(Loc p1, Loc p2) {
 }
 
 array<Loc, 4> neighbors(Loc p) {
-    int x = p % width;
-    int y = p / width;
-    array<Loc, 4> result;
-    result[0] = Loc::pack(x, y == 0 ? height - 1 : y - 1);
-    result[1] = Loc::pack(x == width - 1 ? 0 : x + 1, y);
-    result[2] = Loc::pack(x, y == height - 1 ? 0 : y + 1);
-    result[3] = Loc::pack(x == 0 ? width - 1 : x - 1, y);
-    return result;
+    if (layout.tile != 1) {
+        const auto &n = layout.neighbors[p];
+        return {{n[0], n[1], n[2], n[3]}};
+    }
+    int x = p.x();
+    int y = p.y();
+    return {{
+        y == 0 ? p + area - width : p - width,
+        x == width - 1 ? p - x : p + 1,
+        y == height - 1 ? p - y * width : p + width,
+        x == 0 ? p + width - 1 : p - 1}};
 }
 
-// TODO: more efficient
 Loc move_dst(Loc src, Dir d) {
     assert(d != Dir::still);
     return neighbors(src)[(int)d - 1];
@@ -142,10 +313,23 @@ Loc move_src(Loc dst, Dir d) {
     return move_dst(dst, opposite(d));
 }
 
+TurnVector<Loc> enumerate_neighborhood(Loc p, int radius) {
+    assert(radius >= 0);
+    TurnVector<Loc> result;
+    result.reserve(2 * radius * (radius + 1) + 1);
+    for (int dy = -radius; dy <= radius; dy++) {
+        for (int dx = -radius + abs(dy); dx <= radius - abs(dy); dx++) {
+            result.push_back(p.offset(dx, dy));
+        }
+    }
+    return result;
+}
+
 void init_globals(hlt::GameMap &game_map) {
     ::width = game_map.width;
     ::height = game_map.height;
     ::area = width * height;
+    init_layout(params.layout_tile);
     ::strength.resize(area);
     ::production.resize(area);
     ::owner.resize(area);
@@ -158,7 +342,7 @@ void init_globals(hlt::GameMap &game_map) {
 }
 
 
-void send_moves(map<Loc, Dir> moves) {
+std::set<hlt::Move> to_hlt_moves(const map<Loc, Dir> &moves) {
     std::set<hlt::Move> hlt_moves;
     for (auto kv : moves) {
         Loc p = kv.first;
@@ -167,23 +351,285 @@ void send_moves(map<Loc, Dir> moves) {
         if (d != Dir::still)
             hlt_moves.insert({p.as_hlt_loc(), (unsigned char)d});
     }
-    sendFrame(hlt_moves);
+    return hlt_moves;
+}
+
+void send_moves(map<Loc, Dir> moves) {
+    sendFrame(to_hlt_moves(moves));
 }
 
 
 void show(const vector<int> &board) {
+    ostringstream out;
     for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++)
-            dbg << setw(2) << board[Loc::pack(x, y)] << " ";
-        dbg << endl;
+            out << setw(2) << board[Loc::pack(x, y)] << " ";
+        if (y + 1 < height)
+            out << endl;
+    }
+    debug_line(logging::Raw {out.str()});
+}
+
+
+// Worker threads created once at startup, for the independent phases of a
+// turn (see TaskGraph) and for row bands. A thread waiting for a group of
+// tasks runs queued tasks meanwhile, so tasks can wait for tasks of their
+// own. Without workers (before start_thread_pool(), and in host builds,
+// which keep the board per thread) tasks run on the spot.
+class ThreadPool {
+public:
+    // Tasks that are waited for together. The first exception thrown by
+    // one of them is rethrown by wait().
+    struct Group {
+        atomic<int> pending {0};
+        exception_ptr error;
+    };
+
+    explicit ThreadPool(int num_workers) {
+        for (int i = 0; i < num_workers; i++)
+            workers.emplace_back([this]() { work(); });
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        for (auto &t : workers)
+            t.join();
+    }
+
+    int num_workers() const {
+        return workers.size();
+    }
+
+    void submit(Group &group, function<void()> task) {
+        group.pending++;
+        if (workers.empty()) {
+            run(group, task);
+            return;
+        }
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            queue.push_back({&group, move(task)});
+        }
+        changed.notify_all();
+    }
+
+    void wait(Group &group) {
+        unique_lock<mutex> lock(queue_mutex);
+        while (group.pending > 0) {
+            if (queue.empty()) {
+                changed.wait(lock);
+                continue;
+            }
+            Item item = move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            run(*item.group, item.task);
+            lock.lock();
+        }
+        lock.unlock();
+        if (group.error)
+            rethrow_exception(group.error);
+    }
+
+    // The workers' turn arenas are dropped before their next task; call
+    // when nothing allocated by the turn's tasks is used any more.
+    void release_arenas() {
+        arena_generation++;
+    }
+
+private:
+    struct Item {
+        Group *group;
+        function<void()> task;
+    };
+
+    void run(Group &group, const function<void()> &task) {
+        try {
+            task();
+        } catch (...) {
+            lock_guard<mutex> lock(queue_mutex);
+            if (!group.error)
+                group.error = current_exception();
+        }
+        // The group may be gone as soon as pending drops to zero.
+        group.pending--;
+        if (!workers.empty()) {
+            lock_guard<mutex> lock(queue_mutex);
+            changed.notify_all();
+        }
+    }
+
+    void work() {
+        int generation = arena_generation;
+        unique_lock<mutex> lock(queue_mutex);
+        while (true) {
+            changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping)
+                return;
+            Item item = move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            if (generation != arena_generation) {
+                generation = arena_generation;
+                arena::turn_arena().release();
+            }
+            run(*item.group, item.task);
+            lock.lock();
+        }
     }
+
+    vector<thread> workers;
+    mutex queue_mutex;
+    condition_variable changed;  // queue or some group's pending count
+    deque<Item> queue;
+    bool stopping = false;
+    atomic<int> arena_generation {0};
+};
+
+unique_ptr<ThreadPool> started_pool;
+
+void start_thread_pool(int num_workers) {
+    assert(!started_pool);
+    started_pool.reset(new ThreadPool(num_workers));
+}
+
+ThreadPool& thread_pool() {
+    static ThreadPool inline_pool(0);
+    return started_pool ? *started_pool : inline_pool;
+}
+
+// Tasks with dependencies between them. run() starts each task once the
+// ones it depends on are done and returns when all are, then logs how long
+// each took.
+class TaskGraph {
+public:
+    int add(const char *name, function<void()> task,
+            const vector<int> &dependencies = {}) {
+        int i = nodes.size();
+        nodes.emplace_back(new Node);
+        nodes[i]->name = name;
+        nodes[i]->task = move(task);
+        nodes[i]->remaining = dependencies.size();
+        for (int d : dependencies) {
+            assert(d < i);
+            nodes[d]->dependents.push_back(i);
+        }
+        return i;
+    }
+
+    void run(ThreadPool &pool) {
+        // Collected first: tasks started here may finish, and start their
+        // dependents, before the loop gets to them.
+        vector<int> ready;
+        for (int i = 0; i < (int)nodes.size(); i++)
+            if (nodes[i]->remaining == 0)
+                ready.push_back(i);
+        ThreadPool::Group group;
+        for (int i : ready)
+            start(pool, group, i);
+        pool.wait(group);
+
+        ostringstream out;
+        out << "task microseconds:";
+        for (const auto &node : nodes)
+            out << " " << node->name << " " << node->micros;
+        debug_line(logging::Raw {out.str()});
+    }
+
+private:
+    struct Node {
+        const char *name;
+        function<void()> task;
+        vector<int> dependents;
+        atomic<int> remaining;
+        long long micros = 0;
+    };
+
+    void start(ThreadPool &pool, ThreadPool::Group &group, int i) {
+        pool.submit(group, [this, &pool, &group, i]() {
+            auto &node = *nodes[i];
+            auto begin = chrono::steady_clock::now();
+            node.task();
+            node.micros = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - begin).count();
+            for (int d : node.dependents)
+                if (--nodes[d]->remaining == 0)
+                    start(pool, group, d);
+        });
+    }
+
+    vector<unique_ptr<Node>> nodes;
+};
+
+
+// Set on the speculation worker while it runs. The longest loops of a turn
+// poll it so that stopping speculation does not wait for a whole phase;
+// a phase that gave up early returns partial results, which the caller
+// throws away.
+thread_local const atomic<bool> *cancel_flag = nullptr;
+
+bool cancel_requested() {
+    return cancel_flag && cancel_flag->load(memory_order_relaxed);
+}
+
+
+// Board-wide scans on big maps are split into bands of rows, one task
+// each. Bands only read the shared board, so the halo rows a band looks at
+// beyond its own need no exchange. Bands are whole rows of layout tiles,
+// so the cells of a band are [first_row * width, end_row * width).
+const int MIN_BANDED_AREA = 128 * 128;
+
+int num_row_bands() {
+    if (area < MIN_BANDED_AREA)
+        return 1;
+    int tile_rows = (height + layout.tile - 1) / layout.tile;
+    return max(1, min(thread_pool().num_workers() + 1, tile_rows));
+}
+
+// Calls f(band, first_row, end_row) for every band, in parallel.
+template<typename F>
+void for_row_bands(const F &f) {
+    int n = num_row_bands();
+    int tile_rows = (height + layout.tile - 1) / layout.tile;
+    auto row = [n, tile_rows](int band) {
+        return min(height, tile_rows * band / n * layout.tile);
+    };
+    ThreadPool::Group bands;
+    for (int band = 1; band < n; band++)
+        thread_pool().submit(bands, [&f, &row, band]() {
+            f(band, row(band), row(band + 1));
+        });
+    f(0, 0, row(1));
+    thread_pool().wait(bands);
+}
+
+// Cells for which pred holds, in order.
+template<typename P>
+vector<Loc> collect_cells(const P &pred) {
+    vector<vector<Loc>> found(num_row_bands());
+    for_row_bands([&](int band, int first_row, int end_row) {
+        for (Loc p = first_row * width; p < end_row * width; p++)
+            if (pred(p))
+                found[band].push_back(p);
+    });
+    vector<Loc> result;
+    for (const auto &f : found)
+        result.insert(end(result), begin(f), end(f));
+    return result;
 }
 
 
-vector<int> distance_to_border;
+GAME_LOCAL vector<int> distance_to_border;
 
+// Multi-source BFS from our border cells, over the whole board.
 void precompute() {
     distance_to_border = vector<int>(area, 10000);
+    vector<Loc> queue;
+    queue.reserve(area);
     for (Loc p = 0; p < area; p++) {
         if (owner[p] != myID)
             continue;
@@ -193,14 +639,354 @@ void precompute() {
                 internal = false;
         if (!internal) {
             distance_to_border[p] = 0;
+            queue.push_back(p);
         }
     }
-    for (int i = 0; i < width + height; i++)
-        for (Loc p = 0; p < area; p++)
-            for (Loc n : neighbors(p))
-                distance_to_border[p] = min(
-                    distance_to_border[p],
-                    distance_to_border[n] + 1);
+    for (size_t i = 0; i < queue.size(); i++) {
+        Loc p = queue[i];
+        for (Loc n : neighbors(p)) {
+            if (distance_to_border[n] > distance_to_border[p] + 1) {
+                distance_to_border[n] = distance_to_border[p] + 1;
+                queue.push_back(n);
+            }
+        }
+    }
+}
+
+
+// Isometries of the torus that leave the production plane unchanged.
+// Halite maps are one region repeated for every player by translations and
+// reflections (and on square maps rotations), so these carry each
+// player's region onto the others'. Found once at init: static analyses of
+// the productions only need one cell per orbit.
+struct Symmetry {
+    // (x, y) -> (sx * x + ax, sy * y + ay), wrapping; sx and sy are +-1.
+    // A transposing transform swaps x and y first (square maps only).
+    struct Transform {
+        int sx, ax, sy, ay;
+        bool transpose;
+
+        Loc apply(Loc p) const {
+            int x = transpose ? p.y() : p.x();
+            int y = transpose ? p.x() : p.y();
+            return Loc::pack(
+                ((sx * x + ax) % width + width) % width,
+                ((sy * y + ay) % height + height) % height);
+        }
+    };
+
+    // More than this and the productions are too regular to tell the
+    // regions apart (a flat test map), so none are kept.
+    static const int MAX_TRANSFORMS = 64;
+
+    vector<Transform> transforms;  // all but the identity
+    vector<Loc> representative;  // smallest cell of the orbit
+};
+
+GAME_LOCAL Symmetry symmetry;
+
+// Each half of a transform has to carry the column (row) sums of the
+// productions onto the column (row) sums, or onto the row (column) sums
+// when it transposes, which rules out almost every candidate before the
+// whole board is compared.
+void find_symmetry() {
+    vector<int> column_sums(width, 0);
+    vector<int> row_sums(height, 0);
+    for (Loc p = 0; p < area; p++) {
+        column_sums[p.x()] += production[p];
+        row_sums[p.y()] += production[p];
+    }
+    // (sign, offset) of i -> sign * i + offset that carry the sums in from
+    // onto those in to.
+    auto axis_maps = [](const vector<int> &from, const vector<int> &to) {
+        int n = from.size();
+        vector<pair<int, int>> result;
+        for (int sign : {1, -1}) {
+            for (int offset = 0; offset < n; offset++) {
+                bool same = true;
+                for (int i = 0; i < n && same; i++)
+                    same = to[((sign * i + offset) % n + n) % n] == from[i];
+                if (same)
+                    result.emplace_back(sign, offset);
+            }
+        }
+        return result;
+    };
+
+    auto &s = symmetry;
+    s.transforms.clear();
+    bool too_many = false;
+    for (bool transpose : {false, true}) {
+        if (transpose && width != height)
+            break;
+        // Transposed, the new x comes from y and the new y from x.
+        auto x_maps = transpose ? axis_maps(row_sums, column_sums)
+                                : axis_maps(column_sums, column_sums);
+        auto y_maps = transpose ? axis_maps(column_sums, row_sums)
+                                : axis_maps(row_sums, row_sums);
+        for (auto fy : y_maps) {
+            for (auto fx : x_maps) {
+                Symmetry::Transform t {
+                    fx.first, fx.second, fy.first, fy.second, transpose};
+                if (!transpose && t.sx == 1 && t.ax == 0 &&
+                    t.sy == 1 && t.ay == 0)
+                    continue;
+                bool same = true;
+                for (Loc p = 0; p < area && same; p++)
+                    same = production[t.apply(p)] == production[p];
+                if (!same)
+                    continue;
+                if ((int)s.transforms.size() == Symmetry::MAX_TRANSFORMS) {
+                    too_many = true;
+                    break;
+                }
+                s.transforms.push_back(t);
+            }
+            if (too_many)
+                break;
+        }
+        if (too_many)
+            break;
+    }
+    if (too_many)
+        s.transforms.clear();
+
+    s.representative.resize(area);
+    for (Loc p = 0; p < area; p++) {
+        Loc r = p;
+        for (const auto &t : s.transforms)
+            r = min<int>(r, t.apply(p));
+        s.representative[p] = r;
+    }
+    debug(s.transforms.size());
+}
+
+
+// Productions never change, so init builds these once: a summed-area
+// table of one period of the torus for O(1) rectangle sums, the richest
+// 5x5 clusters, and a potential field that falls off with the distance to
+// them. Box sums and the potential are computed once per symmetry orbit.
+struct ProductionField {
+    static const int CLUSTER_RADIUS = 2;
+    static const int MAX_CLUSTERS = 32;
+    static constexpr float HALF_LIFE = 4.0f;
+
+    vector<int> sat;  // [x + (width + 1) * y], sum over [0, x) x [0, y)
+    vector<pair<int, Loc>> clusters;  // (box sum, center), best first
+    vector<float> potential;
+
+    // Sum over w x h cells starting at (x, y), wrapping around; w and h
+    // are at most width and height.
+    int rect_sum(int x, int y, int w, int h) const {
+        assert(w >= 0 && w <= width && h >= 0 && h <= height);
+        x = (x % width + width) % width;
+        y = (y % height + height) % height;
+        int x1 = min(x + w, width);
+        int y1 = min(y + h, height);
+        int result = period_sum(x, y, x1, y1);
+        if (x + w > width)
+            result += period_sum(0, y, x + w - width, y1);
+        if (y + h > height)
+            result += period_sum(x, 0, x1, y + h - height);
+        if (x + w > width && y + h > height)
+            result += period_sum(0, 0, x + w - width, y + h - height);
+        return result;
+    }
+
+    // Sum over the (2r+1) x (2r+1) box around p.
+    int box_sum(Loc p, int r) const {
+        int w = min(2 * r + 1, width);
+        int h = min(2 * r + 1, height);
+        return rect_sum(p.x() - r, p.y() - r, w, h);
+    }
+
+private:
+    int period_sum(int x0, int y0, int x1, int y1) const {
+        int stride = width + 1;
+        return sat[x1 + stride * y1] - sat[x0 + stride * y1] -
+            sat[x1 + stride * y0] + sat[x0 + stride * y0];
+    }
+};
+
+GAME_LOCAL ProductionField production_field;
+
+// Once per game, after the first init_globals().
+void precompute_static() {
+    find_symmetry();
+    const auto &representative = symmetry.representative;
+
+    auto &f = production_field;
+    int stride = width + 1;
+    f.sat.assign(stride * (height + 1), 0);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            f.sat[x + 1 + stride * (y + 1)] =
+                production[Loc::pack(x, y)] +
+                f.sat[x + stride * (y + 1)] +
+                f.sat[x + 1 + stride * y] -
+                f.sat[x + stride * y];
+
+    const int r = ProductionField::CLUSTER_RADIUS;
+    vector<pair<int, Loc>> boxes;
+    for (Loc p = 0; p < area; p++)
+        boxes.emplace_back(representative[p] == p
+            ? f.box_sum(p, r) : boxes[representative[p]].first, p);
+    sort(begin(boxes), end(boxes), [](pair<int, Loc> a, pair<int, Loc> b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    });
+    // A whole orbit at a time (its smallest cell comes first), so the
+    // clusters are as symmetric as the map: if one cell of the orbit
+    // overlaps a cluster so do the others. Cells of an orbit may overlap
+    // each other across a mirror axis; they are all kept.
+    // Boxes around p and q share cells when both the x and the y distance
+    // (around the torus) are at most 2r.
+    auto boxes_overlap = [r](Loc p, Loc q) {
+        int dx = abs(p.x() - q.x());
+        int dy = abs(p.y() - q.y());
+        return min(dx, width - dx) <= 2 * r && min(dy, height - dy) <= 2 * r;
+    };
+    f.clusters.clear();
+    for (auto box : boxes) {
+        if (representative[box.second] != box.second)
+            continue;
+        bool overlaps = false;
+        for (auto c : f.clusters)
+            if (boxes_overlap(c.second, box.second))
+                overlaps = true;
+        if (overlaps)
+            continue;
+        vector<Loc> orbit {box.second};
+        for (const auto &t : symmetry.transforms) {
+            Loc q = t.apply(box.second);
+            if (find(begin(orbit), end(orbit), q) == end(orbit))
+                orbit.push_back(q);
+        }
+        if (f.clusters.size() + orbit.size() >
+            (size_t)ProductionField::MAX_CLUSTERS)
+            break;
+        for (Loc q : orbit)
+            f.clusters.emplace_back(box.first, q);
+    }
+
+    // The clusters are symmetric, hence so is the potential.
+    float box_area = (2 * r + 1) * (2 * r + 1);
+    f.potential.assign(area, 0.0f);
+    for (Loc p = 0; p < area; p++) {
+        if (representative[p] != p) {
+            f.potential[p] = f.potential[representative[p]];
+            continue;
+        }
+        for (auto c : f.clusters)
+            f.potential[p] = max(f.potential[p],
+                c.first / box_area *
+                exp2(-dist(p, c.second) / ProductionField::HALF_LIFE));
+    }
+    debug(f.clusters);
+}
+
+// What owning p is worth per turn, counting the pull of rich regions
+// nearby.
+float production_value(Loc p) {
+    return production[p] +
+        0.01f * params.potential_percent * production_field.potential[p];
+}
+
+
+// Coarse view of the board in BLOCK_SIZE x BLOCK_SIZE blocks (smaller at
+// the right and bottom edges), rebuilt every turn. Expansion is decided
+// per block first: only the best candidate blocks, neutral blocks next to
+// our territory, get cell-level capture planning and pull reinforcements.
+const int BLOCK_SIZE = 8;
+
+struct Block {
+    int production = 0;
+    int our_cells = 0;
+    int neutral_cells = 0;
+    int enemy_cells = 0;
+    int our_strength = 0;
+    int neutral_production = 0;
+    int neutral_strength = 0;
+    vector<Loc> neutral;  // in order
+
+    float expansion_value() const {
+        return 1.0f * neutral_production / (neutral_strength + 1);
+    }
+};
+
+struct CoarseGrid {
+    int block_width = 0;   // blocks per row
+    int block_height = 0;  // blocks per column
+    vector<Block> blocks;
+    vector<bool> selected;
+
+    int block_of(Loc p) const {
+        return p.x() / BLOCK_SIZE + block_width * (p.y() / BLOCK_SIZE);
+    }
+
+    array<int, 4> block_neighbors(int b) const {
+        int bx = b % block_width;
+        int by = b / block_width;
+        auto pack = [this](int x, int y) {
+            x = (x + block_width) % block_width;
+            y = (y + block_height) % block_height;
+            return x + block_width * y;
+        };
+        return {{pack(bx, by - 1), pack(bx + 1, by),
+                 pack(bx, by + 1), pack(bx - 1, by)}};
+    }
+};
+
+GAME_LOCAL CoarseGrid coarse_grid;
+
+// Call after init_globals().
+void build_coarse_grid() {
+    auto &g = coarse_grid;
+    g.block_width = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    g.block_height = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int num_blocks = g.block_width * g.block_height;
+    g.blocks.assign(num_blocks, Block());
+    for (int b = 0; b < num_blocks; b++) {
+        int x = b % g.block_width * BLOCK_SIZE;
+        int y = b / g.block_width * BLOCK_SIZE;
+        g.blocks[b].production = production_field.rect_sum(
+            x, y, min(BLOCK_SIZE, width - x), min(BLOCK_SIZE, height - y));
+    }
+    for (Loc p = 0; p < area; p++) {
+        auto &block = g.blocks[g.block_of(p)];
+        if (owner[p] == myID) {
+            block.our_cells++;
+            block.our_strength += strength[p];
+        } else if (owner[p] == 0) {
+            block.neutral_cells++;
+            block.neutral_production += production[p];
+            block.neutral_strength += strength[p];
+            block.neutral.push_back(p);
+        } else {
+            block.enemy_cells++;
+        }
+    }
+
+    // Neutral cells next to ours can only be in the same block or in one
+    // of the four adjacent ones.
+    vector<int> candidates;
+    for (int b = 0; b < num_blocks; b++) {
+        if (g.blocks[b].neutral_cells == 0)
+            continue;
+        bool reachable = g.blocks[b].our_cells > 0;
+        for (int n : g.block_neighbors(b))
+            if (g.blocks[n].our_cells > 0)
+                reachable = true;
+        if (reachable)
+            candidates.push_back(b);
+    }
+    stable_sort(begin(candidates), end(candidates), [&g](int a, int b) {
+        return g.blocks[a].expansion_value() > g.blocks[b].expansion_value();
+    });
+    if ((int)candidates.size() > params.capture_blocks)
+        candidates.resize(params.capture_blocks);
+    g.selected.assign(num_blocks, false);
+    for (int b : candidates)
+        g.selected[b] = true;
 }
 
 
@@ -270,7 +1056,7 @@ struct Plan {
 
     double score() const {
         // TODO: prefer moves toward the border
-        return 1.0 * production[target] /
+        return production_value(target) /
             (strength[target] + waste + wait_time * production[target] + 1e-6);
     }
 };
@@ -293,121 +1079,334 @@ vector<vector<T>> cartesian_product(const vector<vector<T>>& v) {
 }
 
 
-vector<map<Loc, Dir>> generate_approaches(
-    const set<Loc> &targets, const set<Loc> &forbidden) {
-
-    set<Loc> froms;
-    for (Loc t : targets)
-        for (Loc n : neighbors(t))
-            if (owner[n] == myID && forbidden.count(n) == 0)
-                froms.insert(n);
-    vector<vector<pair<Loc, Dir>>> choices;
-    for (Loc from : froms) {
-        choices.push_back({{-1, Dir::still}});
-        for (Dir d : all_moves)
-            if (targets.count(move_dst(from, d)))
-                choices.back().emplace_back(from, d);
-    }
-    vector<map<Loc, Dir>> result;
-    for (const auto &comb : cartesian_product(choices)) {
-        result.emplace_back(begin(comb), end(comb));
-        result.back().erase(-1);
-        if (result.back().empty())
-            result.pop_back();
+const int MAX_GATHER_DEPTH = 4;
+
+// Capture plans for a target are gather trees: our cells within
+// MAX_GATHER_DEPTH steps (through our territory) each move to a parent one
+// step closer, timed so that everything reaches the target together.
+struct GatherNode {
+    Loc loc;
+    int depth;
+    int parent;
+    Dir dir;  // toward the parent
+    vector<int> children;
+    bool wasted;
+    int best;
+};
+
+// The tree itself only depends on which cells around the target are ours
+// and movable, and on distance_to_border there (through parent choice and
+// waste). Nodes are in BFS order, node 0 is the target.
+vector<GatherNode> build_gather_tree(
+    Loc target, const TurnSet<Loc> &forbidden) {
+    vector<GatherNode> nodes {{target, 0, -1, Dir::still, {}, false, 0}};
+    TurnSet<Loc> seen {target};
+    for (int i = 0; i < (int)nodes.size(); i++) {
+        if (nodes[i].depth == MAX_GATHER_DEPTH)
+            continue;
+        for (Loc n : neighbors(nodes[i].loc)) {
+            if (owner[n] != myID || forbidden.count(n) || seen.count(n))
+                continue;
+            seen.insert(n);
+            nodes.push_back(
+                {n, nodes[i].depth + 1, -1, Dir::still, {}, false, 0});
+        }
+    }
+
+    // BFS order is also depth order. Among the neighbors one step closer,
+    // prefer the one the move toward which is not wasted.
+    TurnMap<Loc, int> index;
+    for (int i = 0; i < (int)nodes.size(); i++)
+        index[nodes[i].loc] = i;
+    for (int i = 1; i < (int)nodes.size(); i++) {
+        auto &node = nodes[i];
+        for (Dir d : all_moves) {
+            auto it = index.find(move_dst(node.loc, d));
+            if (it == index.end() || nodes[it->second].depth != node.depth - 1)
+                continue;
+            if (node.parent == -1 ||
+                distance_to_border[nodes[it->second].loc] <
+                distance_to_border[nodes[node.parent].loc]) {
+                node.parent = it->second;
+                node.dir = d;
+            }
+        }
+        assert(node.parent != -1);
+        nodes[node.parent].children.push_back(i);
+        node.wasted = distance_to_border[node.loc] <=
+            distance_to_border[nodes[node.parent].loc];
     }
-    return result;
+    return nodes;
 }
 
 
+// Gather trees from previous turns. Most of the border looks the same from
+// one turn to the next apart from strength, so trees are only rebuilt where
+// ownership, movability or the distance field changed around the target.
+// The speculation worker keeps a cache of its own, so the predicted boards
+// neither evict the real board's trees nor count in its hit rate.
+class GatherTreeCache {
+public:
+    vector<GatherNode>& get(Loc target, const TurnSet<Loc> &forbidden) {
+        vector<int> key;
+        key.reserve(2 * MAX_GATHER_DEPTH * (MAX_GATHER_DEPTH + 1) + 2);
+        key.push_back(distance_to_border[target]);
+        for (Loc n : enumerate_neighborhood(target, MAX_GATHER_DEPTH))
+            key.push_back(owner[n] == myID && forbidden.count(n) == 0
+                ? distance_to_border[n] : -1);
+
+        auto &entry = entries[target];
+        entry.last_used = turn;
+        if (entry.key != key) {
+            misses++;
+            entry.key = move(key);
+            entry.tree = build_gather_tree(target, forbidden);
+        } else {
+            hits++;
+        }
+        return entry.tree;
+    }
+
+    // Forgets targets that were not looked at since the last call.
+    void next_turn() {
+        hits = misses = 0;
+        for (auto it = begin(entries); it != end(entries);) {
+            if (it->second.last_used != turn)
+                it = entries.erase(it);
+            else
+                ++it;
+        }
+        turn++;
+    }
+
+    int hits = 0;
+    int misses = 0;
+
+private:
+    struct Entry {
+        vector<int> key;
+        vector<GatherNode> tree;
+        int last_used;
+    };
+    map<Loc, Entry> entries;
+    int turn = 0;
+};
+
+GAME_LOCAL GatherTreeCache gather_tree_cache;
+
+
+// A cell at depth k in a tree of depth D waits D - k turns and is worth
+// strength + (D - k) * production, minus its production if the move is
+// wasted. For each D the best subtrees are found bottom-up in one pass, and
+// the subtrees of the target's neighbors are taken in order of value until
+// the target can be captured without waiting.
 template<typename BACK_INSERTER>
 void generate_capture_plans(
-    Loc target, const set<Loc> &forbidden, BACK_INSERTER emit) {
+    Loc target, const TurnSet<Loc> &forbidden, GatherTreeCache &cache,
+    BACK_INSERTER emit) {
 
     assert(owner[target] == 0);
-    for (const auto &app : generate_approaches({target}, forbidden)) {
-        *emit++ = Plan {target, {app}};
 
-        set<Loc> layer2;
-        for (auto kv : app)
-            layer2.insert(kv.first);
-        for (const auto &app2 : generate_approaches(layer2, forbidden))
-            *emit++ = Plan {target, {app2, app}};
+    bool reachable = false;
+    for (Loc n : neighbors(target))
+        if (owner[n] == myID && forbidden.count(n) == 0)
+            reachable = true;
+    if (!reachable)
+        return;
+
+    auto &nodes = cache.get(target, forbidden);
+
+    int max_depth = nodes.back().depth;
+    for (int depth = 1; depth <= max_depth; depth++) {
+        auto contribution = [depth](const GatherNode &node) {
+            return strength[node.loc] +
+                (depth - node.depth) * production[node.loc];
+        };
+        for (int i = (int)nodes.size() - 1; i > 0; i--) {
+            auto &node = nodes[i];
+            if (node.depth > depth)
+                continue;
+            node.best = contribution(node);
+            if (node.wasted)
+                node.best -= production[node.loc];
+            for (int c : node.children)
+                if (nodes[c].depth <= depth)
+                    node.best += max(0, nodes[c].best);
+        }
+
+        TurnVector<int> roots(
+            begin(nodes[0].children), end(nodes[0].children));
+        sort(begin(roots), end(roots), [&nodes](int i, int j) {
+            return nodes[i].best > nodes[j].best;
+        });
+
+        vector<map<Loc, Dir>> moves(depth);
+        int total = 0;
+        for (int r : roots) {
+            if (nodes[r].best <= 0 || total > strength[target])
+                break;
+            TurnVector<int> stack {r};
+            while (!stack.empty()) {
+                const auto &node = nodes[stack.back()];
+                stack.pop_back();
+                total += contribution(node);
+                moves[depth - node.depth][node.loc] = node.dir;
+                for (int c : node.children)
+                    if (nodes[c].depth <= depth && nodes[c].best > 0)
+                        stack.push_back(c);
+            }
+        }
+        // Deeper layers may have been left out.
+        while (!moves.empty() && moves.front().empty())
+            moves.erase(begin(moves));
+        if (!moves.empty() && (int)moves.size() == depth)
+            *emit++ = Plan {target, moves};
     }
 }
 
 
-map<Loc, Dir> generate_capture_moves(const set<Loc> &forbidden) {
-    vector<Plan> plans;
+map<Loc, Dir> generate_capture_moves(
+    const TurnSet<Loc> &forbidden,
+    GatherTreeCache &cache = gather_tree_cache) {
+    TurnVector<Loc> targets;
+    for (int b = 0; b < (int)coarse_grid.blocks.size(); b++)
+        if (coarse_grid.selected[b])
+            targets.insert(end(targets),
+                begin(coarse_grid.blocks[b].neutral),
+                end(coarse_grid.blocks[b].neutral));
+    sort(begin(targets), end(targets));
 
-    for (Loc target = 0; target < area; target++)
-        if (owner[target] == 0)
-            generate_capture_plans(target, forbidden, back_inserter(plans));
+    vector<Plan> plans;
+    for (Loc target : targets) {
+        if (cancel_requested())
+            return {};
+        generate_capture_plans(
+            target, forbidden, cache, back_inserter(plans));
+    }
+    debug2(cache.hits, cache.misses);
+    cache.next_turn();
+
+    // Greedily take the best plan that does not overlap the ones taken so
+    // far (ties go to the earlier plan).
+    TurnVector<double> scores;
+    for (const auto &plan : plans)
+        scores.push_back(plan.score());
+    TurnVector<int> order(plans.size());
+    iota(begin(order), end(order), 0);
+    stable_sort(begin(order), end(order), [&scores](int i, int j) {
+        return scores[i] > scores[j];
+    });
 
     map<Loc, Dir> moves;
-
-    while (!plans.empty()) {
-        auto best = max_element(
-            begin(plans), end(plans),
-            [](const Plan &p1, const Plan &p2) {
-                return p1.score() < p2.score();
-            });
-        for (auto kv : best->initial_moves()) {
+    TurnVector<bool> used(area, false);
+    for (int i : order) {
+        const auto &plan = plans[i];
+        bool overlaps = false;
+        for (Loc p : plan.footprint)
+            if (used[p])
+                overlaps = true;
+        if (overlaps)
+            continue;
+        for (Loc p : plan.footprint)
+            used[p] = true;
+        for (auto kv : plan.initial_moves()) {
             assert(moves.count(kv.first) == 0);
             moves.insert(kv);
         }
-
-        auto f = best->footprint;
-        plans.erase(
-            remove_if(
-                begin(plans), end(plans),
-                [&f](const Plan &p) {
-                    vector<Loc> overlap;
-                    set_intersection(
-                        begin(f), end(f),
-                        begin(p.footprint), end(p.footprint),
-                        back_inserter(overlap));
-                    return !overlap.empty();
-                }),
-            end(plans));
     }
     return moves;
 }
 
 
+// Interior cells are routed down distance_to_border toward the border
+// cells that need strength most. Demand of a border cell is the best
+// production/strength ratio among the cells it could take (enemy cells count
+// as 1); interior cells inherit the demand of their best inner neighbor.
+// Cells are decided in order of increasing distance_to_border while keeping
+// track of the projected strength of every cell, so merges that would go
+// over 255 are avoided. Everything is a constant number of passes over the
+// board.
 map<Loc, Dir> generate_reinforcement_moves() {
     // TODO: avoid interference with capture plans
-    // (currently we just overwrite reinforcement moves with captures)
-    map<Loc, Dir> moves;
+    // (currently these moves take precedence, see merge_moves())
+    vector<vector<Loc>> layers;
     for (Loc p = 0; p < area; p++) {
-        if (owner[p] != myID || distance_to_border[p] == 0)
-            continue;
-        if (strength[p] < 6 * production[p])
+        if (owner[p] != myID)
             continue;
-        float best_score = -1e10;
-        Dir best_dir = Dir::still;
-        for (Dir d : all_moves) {
-            Loc to = move_dst(p, d);
-            if (distance_to_border[to] >= distance_to_border[p])
+        int d = distance_to_border[p];
+        if (d >= (int)layers.size())
+            layers.resize(d + 1);
+        layers[d].push_back(p);
+    }
+
+    vector<float> demand(area, 0.0f);
+    vector<int> projected(area, 0);
+    for (int d = 0; d < (int)layers.size(); d++) {
+        if (cancel_requested())
+            return {};
+        for (Loc p : layers[d]) {
+            projected[p] = strength[p] + production[p];
+            for (Loc n : neighbors(p)) {
+                if (d == 0 && owner[n] != myID &&
+                    (owner[n] != 0 ||
+                     coarse_grid.selected[coarse_grid.block_of(n)]))
+                    demand[p] = max(demand[p], owner[n] == 0
+                        ? production_value(n) / (strength[n] + 1)
+                        : 1.0f);
+                if (d > 0 && distance_to_border[n] == d - 1)
+                    demand[p] = max(demand[p], demand[n]);
+            }
+        }
+    }
+
+    map<Loc, Dir> moves;
+    for (int d = 1; d < (int)layers.size(); d++) {
+        if (cancel_requested())
+            return {};
+        for (Loc p : layers[d]) {
+            if (strength[p] < params.reinforce_threshold * production[p])
                 continue;
-            float score = 1000 - abs(strength[to] - 128);
-            if (score > best_score) {
-                best_score = score;
-                best_dir = d;
+            // Prefer the least overflow, then the highest demand, then the
+            // old heuristic. Stay only if every move overflows more.
+            int best_overflow = max(0, projected[p] - 255);
+            auto best_score = make_pair(-1.0f, -1000);
+            Dir best_dir = Dir::still;
+            for (Dir dir : all_moves) {
+                Loc to = move_dst(p, dir);
+                if (distance_to_border[to] >= d)
+                    continue;
+                int overflow = max(0, projected[to] + strength[p] - 255);
+                auto score = make_pair(demand[to], -abs(strength[to] - params.reinforce_target));
+                if (overflow < best_overflow ||
+                    (overflow == best_overflow && score > best_score)) {
+                    best_overflow = overflow;
+                    best_score = score;
+                    best_dir = dir;
+                }
+            }
+            moves[p] = best_dir;
+            if (best_dir != Dir::still) {
+                projected[p] -= strength[p] + production[p];
+                projected[move_dst(p, best_dir)] += strength[p];
             }
         }
-        moves[p] = best_dir;
     }
     return moves;
 }
 
 
+// At most 13 cells contribute to a diamond, plus neutral.
+const int MAX_DIAMOND_OWNERS = 14;
+
 struct DiamondOutcome {
     int strength = -1;
     int owner = -1;
     int evaluate(Loc p) const {
         if (owner == 0)
             return 0;
-        int res = strength + ::production[p] * (experiment ? 3 : 1);
+        int res = strength + ::production[p] * (experiment
+            ? params.production_weight_experiment
+            : params.production_weight);
         if (owner == myID)
             return res;
         else
@@ -415,91 +1414,49 @@ struct DiamondOutcome {
     }
 };
 
-template<typename F>
-DiamondOutcome simulate_diamond(Loc p, const F &get_move) {
-    const int MAX_ID = 7;
-    assert(owner[p] < MAX_ID);
-
+// Resolves one cell once the contributions of every owner in its diamond
+// are known. Owners are compact indices, 0 is always neutral. K is the
+// number of owners when known at compile time (loops fully unroll), or 0.
+template<int K>
+DiamondOutcome resolve_diamond(
+    int k, const int *ids, const int *arrive, const bool *attack,
+    const int *damage, int center_owner) {
+    const int n = K > 0 ? K : k;
     DiamondOutcome result;
 
-    int arrive[MAX_ID] = {0};
-    bool attack[MAX_ID] = {false};
-    int damage[MAX_ID] = {0};  // from neighbors
-
-    attack[owner[p]] = true;
-    if (get_move(p) == Dir::still) {
-        arrive[owner[p]] += strength[p];
-        if (owner[p])
-            arrive[owner[p]] += production[p];
-    } else {
-        arrive[owner[p]] = 0;
-        damage[owner[p]] += strength[p];
-    }
-
-    for (Dir d : all_moves) {
-        Loc q = move_src(p, d);
-        Dir move = get_move(q);
-        if (move == d)
-            arrive[owner[q]] += strength[q];
-        if ((move == d || move == Dir::still) && owner[q]) {
-            attack[owner[q]] = true;
-            if (move == Dir::still)
-                damage[owner[q]] += strength[q] + production[q];
-        }
-
-        Dir d2 = turn_cw(d);
-        Loc q2 = move_src(q, d2);
-        move = get_move(q2);
-        if (owner[q2] && (move == d || move == d2)) {
-            attack[owner[q2]] = true;
-            damage[owner[q2]] += strength[q2];
-        }
-
-        q2 = move_src(q, d);
-        move = get_move(q2);
-        if (owner[q2] && move == d) {
-            attack[owner[q2]] = true;
-            damage[owner[q2]] += strength[q2];
-        }
-    }
-    assert(damage[0] == 0);
-
-    // cout << vector<int>(arrive, arrive + MAX_ID) << endl;
-    // cout << vector<int>(damage, damage + MAX_ID) << endl;
-
-    int survive[MAX_ID];
-    for (int i = 0; i < MAX_ID; i++)
+    int survive[K > 0 ? K : MAX_DIAMOND_OWNERS];
+    for (int i = 0; i < n; i++)
         survive[i] = min(arrive[i], 255);
 
-    for (int i = 0; i < MAX_ID; i++) {
+    int total_arrive = 0;
+    int total_damage = 0;
+    for (int i = 0; i < n; i++) {
+        total_arrive += arrive[i];
+        total_damage += damage[i];
+    }
+    for (int i = 0; i < n; i++) {
         if (survive[i] <= 0)
             continue;
-        for (int j = 0; j < MAX_ID; j++) {
-            if (i != j) {
-                survive[i] -= arrive[j];
-                if (i)
-                    survive[i] -= damage[j];
-            }
-        }
+        survive[i] -= total_arrive - arrive[i];
+        if (i)
+            survive[i] -= total_damage - damage[i];
     }
 
     int cnt = 0;
-    for (int i = 0; i < MAX_ID; i++) {
+    for (int i = 0; i < n; i++) {
         if (survive[i] > 0) {
             cnt++;
-            result.owner = i;
+            result.owner = ids[i];
             result.strength = survive[i];
         }
     }
-    // cout << vector<int>(survive, survive + MAX_ID) << endl;
-    // cout << endl;
     assert(cnt <= 1);
 
     if (cnt == 0) {
         result.strength = 0;
-        result.owner = owner[p];
-        for (int i = 1; i < MAX_ID; i++) {
-            if (attack[i] && i != owner[p]) {
+        result.owner = center_owner;
+        for (int i = 1; i < n; i++) {
+            if (attack[i] && ids[i] != center_owner) {
                 result.owner = 0;
                 break;
             }
@@ -509,11 +1466,81 @@ DiamondOutcome simulate_diamond(Loc p, const F &get_move) {
     return result;
 }
 
+template<typename F>
+DiamondOutcome simulate_diamond(Loc p, const F &get_move) {
+    // Owners present in the diamond, remapped to 0..k-1.
+    int ids[MAX_DIAMOND_OWNERS] = {0};
+    int k = 1;
+    auto index_of = [&ids, &k](int o) {
+        for (int i = 0; i < k; i++)
+            if (ids[i] == o)
+                return i;
+        ids[k] = o;
+        return k++;
+    };
+
+    int arrive[MAX_DIAMOND_OWNERS] = {0};
+    bool attack[MAX_DIAMOND_OWNERS] = {false};
+    int damage[MAX_DIAMOND_OWNERS] = {0};  // from neighbors
+
+    int o = index_of(owner[p]);
+    attack[o] = true;
+    if (get_move(p) == Dir::still) {
+        arrive[o] += strength[p];
+        if (owner[p])
+            arrive[o] += production[p];
+    } else {
+        damage[o] += strength[p];
+    }
+
+    for (Dir d : all_moves) {
+        Loc q = move_src(p, d);
+        Dir move = get_move(q);
+        if (move == d || (move == Dir::still && owner[q])) {
+            o = index_of(owner[q]);
+            if (move == d)
+                arrive[o] += strength[q];
+            if (owner[q]) {
+                attack[o] = true;
+                if (move == Dir::still)
+                    damage[o] += strength[q] + production[q];
+            }
+        }
+
+        Dir d2 = turn_cw(d);
+        Loc q2 = move_src(q, d2);
+        move = get_move(q2);
+        if (owner[q2] && (move == d || move == d2)) {
+            o = index_of(owner[q2]);
+            attack[o] = true;
+            damage[o] += strength[q2];
+        }
+
+        q2 = move_src(q, d);
+        move = get_move(q2);
+        if (owner[q2] && move == d) {
+            o = index_of(owner[q2]);
+            attack[o] = true;
+            damage[o] += strength[q2];
+        }
+    }
+    assert(damage[0] == 0);
+
+    switch (k) {
+    case 1: return resolve_diamond<1>(k, ids, arrive, attack, damage, owner[p]);
+    case 2: return resolve_diamond<2>(k, ids, arrive, attack, damage, owner[p]);
+    case 3: return resolve_diamond<3>(k, ids, arrive, attack, damage, owner[p]);
+    default: return resolve_diamond<0>(k, ids, arrive, attack, damage, owner[p]);
+    }
+}
+
 
+// Row-major, whatever the layout.
 vector<int> input_board() {
     vector<int> result(area);
-    for (int &x : result)
-        cin >> x;
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            cin >> result[Loc::pack(x, y)];
     return result;
 }
 
@@ -523,6 +1550,7 @@ int test_simulate_diamond() {
     while (cin >> ::width) {
         cin >> ::height;
         ::area = width * height;
+        init_layout(params.layout_tile);
         cout << "test#" << i << ": " << ::width << " x " << ::height << endl;
 
         string s;
@@ -596,24 +1624,238 @@ int test_simulate_diamond() {
 }
 
 
-vector<Loc> enumerate_neighborhood(Loc p, int radius) {
-    assert(radius >= 0);
-    vector<Loc> result;
-    for (int dy = -radius; dy <= radius; dy++) {
-        for (int dx = -radius + abs(dy); dx <= radius - abs(dy); dx++) {
-            result.push_back(p.offset(dx, dy));
+GAME_LOCAL vector<Dir> moves_scratch;
+struct GetMoveScratch {
+    Dir operator()(Loc p) const { return moves_scratch[p]; }
+} get_move_scratch;
+
+
+// Scores many assignments of moves to the same points in one pass, for
+// the sum of evaluate() over every diamond the points affect. Per diamond
+// the static owner/strength/production of its 13 cells is read once and
+// the cells that are not candidate points go into per-owner base sums.
+// The candidates sit in the lanes of structure-of-arrays accumulators,
+// EVAL_LANES at a time: the moves of a batch are stored [point][lane],
+// and each candidate point is applied by a branch-free loop over the
+// lanes specific to its role in the diamond, which the compiler
+// vectorizes, as it does the resolution across lanes.
+//
+// Owners get fixed indices per diamond (neutral first); owners that do not
+// contribute in a lane keep zero strength and cannot change the outcome,
+// so the result is the same as simulate_diamond().
+const int EVAL_LANES = 8;
+
+vector<float> evaluate_candidates(
+    const vector<Loc> &points, const vector<vector<Dir>> &values) {
+    TurnVector<Loc> centers;
+    for (Loc p : points)
+        for (Loc n : enumerate_neighborhood(p, 2))
+            centers.push_back(n);
+    sort(begin(centers), end(centers));
+    centers.erase(unique(begin(centers), end(centers)), end(centers));
+
+    int weight = experiment
+        ? params.production_weight_experiment : params.production_weight;
+    vector<float> result(values.size(), 0.0f);
+
+    // Unused lanes of the last batch stay still; their scores are dropped.
+    TurnVector<Dir> lane_moves(points.size() * EVAL_LANES, Dir::still);
+    for (int first = 0; first < (int)values.size(); first += EVAL_LANES) {
+        int num_lanes = min(EVAL_LANES, (int)values.size() - first);
+        for (int l = 0; l < num_lanes; l++) {
+            assert(values[first + l].size() == points.size());
+            for (int j = 0; j < (int)points.size(); j++)
+                lane_moves[j * EVAL_LANES + l] = values[first + l][j];
+        }
+
+        for (Loc p : centers) {
+            int ids[MAX_DIAMOND_OWNERS] = {0};
+            int k = 1;
+            auto index_of = [&ids, &k](int o) {
+                for (int i = 0; i < k; i++)
+                    if (ids[i] == o)
+                        return i;
+                ids[k] = o;
+                return k++;
+            };
+
+            // Contribution of cell c (owner index o) when it makes the
+            // given move; which moves count depends on its role.
+            enum Role { CENTER, SIDE, DIAGONAL, STRAIGHT };
+            auto contribute = [&](
+                Role role, Loc c, Dir d, Dir move,
+                int &arrive, int &damage, int &attack) {
+                bool owned = owner[c] != 0;
+                bool still = move == Dir::still;
+                switch (role) {
+                case CENTER:
+                    attack = true;
+                    if (still)
+                        arrive += strength[c] + (owned ? production[c] : 0);
+                    else
+                        damage += strength[c];
+                    break;
+                case SIDE:
+                    if (move == d)
+                        arrive += strength[c];
+                    if (owned && (move == d || still))
+                        attack = true;
+                    if (owned && still)
+                        damage += strength[c] + production[c];
+                    break;
+                case DIAGONAL:
+                    if (owned && (move == d || move == turn_cw(d))) {
+                        attack = true;
+                        damage += strength[c];
+                    }
+                    break;
+                case STRAIGHT:
+                    if (owned && move == d) {
+                        attack = true;
+                        damage += strength[c];
+                    }
+                    break;
+                }
+            };
+
+            // Cells that are not candidate points move the same way in
+            // every lane: they go into the scalar base once.
+            int base_arrive[MAX_DIAMOND_OWNERS] = {0};
+            int base_damage[MAX_DIAMOND_OWNERS] = {0};
+            int base_attack[MAX_DIAMOND_OWNERS] = {0};
+            struct Varying {
+                Role role;
+                Loc c;
+                Dir d;
+                int o;
+                int j;  // index in points
+            };
+            Varying varying[13];
+            int num_varying = 0;
+            auto add = [&](Role role, Loc c, Dir d) {
+                if (role != CENTER && role != SIDE && !owner[c])
+                    return;
+                int o = index_of(owner[c]);
+                int j = find(begin(points), end(points), c) - begin(points);
+                if (j < (int)points.size()) {
+                    varying[num_varying++] = {role, c, d, o, j};
+                    // The center attacks whatever its move.
+                    if (role == CENTER)
+                        base_attack[o] = true;
+                } else {
+                    contribute(role, c, d, moves_scratch[c],
+                        base_arrive[o], base_damage[o], base_attack[o]);
+                }
+            };
+            add(CENTER, p, Dir::still);
+            for (Dir d : all_moves) {
+                Loc q = move_src(p, d);
+                add(SIDE, q, d);
+                add(DIAGONAL, move_src(q, turn_cw(d)), d);
+                add(STRAIGHT, move_src(q, d), d);
+            }
+
+            int arrive[MAX_DIAMOND_OWNERS][EVAL_LANES];
+            int damage[MAX_DIAMOND_OWNERS][EVAL_LANES];
+            int attack[MAX_DIAMOND_OWNERS][EVAL_LANES];
+            for (int i = 0; i < k; i++) {
+                for (int l = 0; l < EVAL_LANES; l++) {
+                    arrive[i][l] = base_arrive[i];
+                    damage[i][l] = base_damage[i];
+                    attack[i][l] = base_attack[i];
+                }
+            }
+            for (int v = 0; v < num_varying; v++) {
+                const auto &cell = varying[v];
+                const Dir *m = &lane_moves[cell.j * EVAL_LANES];
+                int o = cell.o;
+                Dir d = cell.d;
+                int s = strength[cell.c];
+                // Only owned cells damage or attack from the sides.
+                int owned = owner[cell.c] != 0;
+                int stay = s + (owned ? production[cell.c] : 0);
+                switch (cell.role) {
+                case CENTER:
+                    for (int l = 0; l < EVAL_LANES; l++) {
+                        bool still = m[l] == Dir::still;
+                        arrive[o][l] += still ? stay : 0;
+                        damage[o][l] += still ? 0 : s;
+                    }
+                    break;
+                case SIDE:
+                    for (int l = 0; l < EVAL_LANES; l++) {
+                        bool in = m[l] == d;
+                        bool still = m[l] == Dir::still;
+                        arrive[o][l] += in ? s : 0;
+                        attack[o][l] |= owned & (in | still);
+                        damage[o][l] += owned && still ? stay : 0;
+                    }
+                    break;
+                case DIAGONAL: {
+                    Dir d2 = turn_cw(d);
+                    for (int l = 0; l < EVAL_LANES; l++) {
+                        bool hit = m[l] == d || m[l] == d2;
+                        attack[o][l] |= hit;
+                        damage[o][l] += hit ? s : 0;
+                    }
+                    break;
+                }
+                case STRAIGHT:
+                    for (int l = 0; l < EVAL_LANES; l++) {
+                        bool hit = m[l] == d;
+                        attack[o][l] |= hit;
+                        damage[o][l] += hit ? s : 0;
+                    }
+                    break;
+                }
+            }
+
+            // resolve_diamond, across lanes.
+            int total_arrive[EVAL_LANES] = {0};
+            int total_damage[EVAL_LANES] = {0};
+            for (int i = 0; i < k; i++) {
+                for (int l = 0; l < EVAL_LANES; l++) {
+                    total_arrive[l] += arrive[i][l];
+                    total_damage[l] += damage[i][l];
+                }
+            }
+            int survivor[EVAL_LANES];
+            int survivor_strength[EVAL_LANES] = {0};
+            int contested[EVAL_LANES] = {0};
+            for (int l = 0; l < EVAL_LANES; l++)
+                survivor[l] = -1;
+            for (int i = 0; i < k; i++) {
+                // Neutral takes no damage.
+                int hurt = i != 0;
+                for (int l = 0; l < EVAL_LANES; l++) {
+                    int survive = min(arrive[i][l], 255);
+                    int lost = total_arrive[l] - arrive[i][l] +
+                        hurt * (total_damage[l] - damage[i][l]);
+                    survive -= survive > 0 ? lost : 0;
+                    survivor[l] = survive > 0 ? i : survivor[l];
+                    survivor_strength[l] =
+                        survive > 0 ? survive : survivor_strength[l];
+                }
+                if (i && ids[i] != owner[p])
+                    for (int l = 0; l < EVAL_LANES; l++)
+                        contested[l] |= attack[i][l];
+            }
+
+            for (int l = 0; l < num_lanes; l++) {
+                int new_owner = survivor[l] >= 0
+                    ? ids[survivor[l]]
+                    : (contested[l] ? 0 : owner[p]);
+                if (new_owner == 0)
+                    continue;
+                int value = survivor_strength[l] + production[p] * weight;
+                result[first + l] += new_owner == myID ? value : -value;
+            }
         }
     }
     return result;
 }
 
 
-vector<Dir> moves_scratch;
-struct GetMoveScratch {
-    Dir operator()(Loc p) const { return moves_scratch[p]; }
-} get_move_scratch;
-
-
 class OpponentModel {
 public:
     float evaluate_board(const map<Loc, Dir> &moves) const {
@@ -624,60 +1866,34 @@ public:
             result += simulate_diamond(p, get_move_scratch).evaluate(p);
         return result;
     }
-
-    vector<float> evaluate_relative_local(
-        const vector<Loc> &points,
-        const vector<vector<Dir>> &values) {
-        set<Loc> affected_diamonds;
-        for (Loc p : points)
-            for (Loc n : enumerate_neighborhood(p, 2))
-                affected_diamonds.insert(n);
-
-        vector<float> result;
-        for (const auto &value : values) {
-            float score = 0.0;
-            assert(value.size() == points.size());
-            for (int i = 0; i < (int)value.size(); i++)
-                moves_scratch[points[i]] = value[i];
-            for (auto p : affected_diamonds)
-                score += simulate_diamond(p, get_move_scratch).evaluate(p);
-            result.push_back(score);
-        }
-        return result;
-    }
 };
 
 
+int combat_radius() {
+    return experiment
+        ? params.combat_radius_experiment : params.combat_radius;
+}
+
 vector<Loc> list_our_combat_pieces() {
-    vector<Loc> result;
-    for (Loc p = 0; p < area; p++) {
+    return collect_cells([](Loc p) {
         if (owner[p] != myID)
-            continue;
-        bool combat = false;
-        for (Loc n : enumerate_neighborhood(p, experiment ? 3 : 2)) {
+            return false;
+        for (Loc n : enumerate_neighborhood(p, combat_radius()))
             if (owner[n] && owner[n] != myID)
-                combat = true;
-        }
-        if (combat)
-            result.push_back(p);
-    }
-    return result;
+                return true;
+        return false;
+    });
 }
 
 vector<Loc> list_opp_combat_pieces() {
-    vector<Loc> result;
-    for (Loc p = 0; p < area; p++) {
+    return collect_cells([](Loc p) {
         if (owner[p] == 0 || owner[p] == myID)
-            continue;
-        bool combat = false;
-        for (Loc n : enumerate_neighborhood(p, experiment ? 3 : 2)) {
+            return false;
+        for (Loc n : enumerate_neighborhood(p, combat_radius()))
             if (owner[n] == myID)
-                combat = true;
-        }
-        if (combat)
-            result.push_back(p);
-    }
-    return result;
+                return true;
+        return false;
+    });
 }
 
 
@@ -687,8 +1903,9 @@ struct Encoder {
     vector<pair<Loc, array<int, 5>>> offsets;
 
     void add(Loc p, array<int, 5> classes) {
-        set<int> all_classes_set(begin(classes), end(classes));
-        vector<int> all_classes(begin(all_classes_set), end(all_classes_set));
+        TurnSet<int> all_classes_set(begin(classes), end(classes));
+        TurnVector<int> all_classes(
+            begin(all_classes_set), end(all_classes_set));
         if (all_classes.size() == 1)
             return;
         offsets.emplace_back();
@@ -702,8 +1919,8 @@ struct Encoder {
         range *= all_classes.size();
     }
 
-    vector<Dir> decode_representative(int x) const {
-        vector<Dir> result(offsets.size(), Dir::still);
+    TurnVector<Dir> decode_representative(int x) const {
+        TurnVector<Dir> result(offsets.size(), Dir::still);
         assert(x >= 0 && x < range);
         for (int i = (int)offsets.size() - 1; i >= 0; i--) {
             const auto &q = offsets[i].second;
@@ -719,27 +1936,35 @@ struct Encoder {
         return result;
     }
 
-    void apply_to_scratch(const vector<Dir> &dirs) const {
+    void apply_to_scratch(const TurnVector<Dir> &dirs) const {
         assert(dirs.size() == offsets.size());
         for (int i = 0; i < (int)dirs.size(); i++)
             moves_scratch[offsets[i].first] = dirs[i];
     }
 
-    vector<Dir> read_from_scratch() const {
-        vector<Dir> result;
+    TurnVector<Dir> read_from_scratch() const {
+        TurnVector<Dir> result;
         result.reserve(offsets.size());
         for (const auto &off : offsets)
             result.push_back(moves_scratch[off.first]);
         return result;
     }
 
-    int encode(const vector<Dir> &dirs) const {
+    int encode(const TurnVector<Dir> &dirs) const {
         int result = 0;
         assert(dirs.size() == offsets.size());
         for (int i = 0; i < (int)dirs.size(); i++)
             result += offsets[i].second[(int)dirs[i]];
         return result;
     }
+
+    // Same as encode(read_from_scratch()), without the temporary.
+    int encode_scratch() const {
+        int result = 0;
+        for (const auto &off : offsets)
+            result += off.second[(int)moves_scratch[off.first]];
+        return result;
+    }
 };
 
 
@@ -749,14 +1974,16 @@ struct DiamondInfo {
     Encoder our_encoder;
     Encoder opp_encoder;
 
-    vector<Loc> enumerate_affected() const {
-        vector<Loc> result;
-        for (const auto &e : {our_encoder, opp_encoder})
-            for (const auto &off : e.offsets)
-                result.push_back(off.first);
-        return result;
+    long long size() const {
+        return (long long)our_encoder.range * opp_encoder.range;
     }
 
+    // Diamonds that fit into the per-turn budget keep the whole matrix and
+    // the mixed strategy scores as vectors. Crowded ones evaluate entries on
+    // demand, cache them, and keep the mixed strategies as lists of played
+    // offsets instead.
+    bool dense = true;
+
     vector<float> score_matrix;
     // [our_offset + our_encoder.range * opp_offset]
 
@@ -765,25 +1992,90 @@ struct DiamondInfo {
     int our_mix_count = 0;
     int opp_mix_count = 0;
 
+    // When not dense: offset -> times played.
+    map<int, int> our_played;
+    map<int, int> opp_played;
+    mutable unordered_map<long long, float> lazy_scores;
+
+    float score(int our_offset, int opp_offset) const {
+        if (dense)
+            return score_matrix[our_offset + our_encoder.range * opp_offset];
+        long long key = our_offset + (long long)our_encoder.range * opp_offset;
+        auto it = lazy_scores.find(key);
+        if (it != lazy_scores.end())
+            return it->second;
+        return lazy_scores[key] = evaluate(our_offset, opp_offset);
+    }
+
+    // Simulates the center with the given representatives, leaving
+    // moves_scratch as it was.
+    float evaluate(int our_offset, int opp_offset) const {
+        auto our_saved = our_encoder.read_from_scratch();
+        auto opp_saved = opp_encoder.read_from_scratch();
+        our_encoder.apply_to_scratch(
+            our_encoder.decode_representative(our_offset));
+        opp_encoder.apply_to_scratch(
+            opp_encoder.decode_representative(opp_offset));
+        float result =
+            simulate_diamond(center, get_move_scratch).evaluate(center);
+        our_encoder.apply_to_scratch(our_saved);
+        opp_encoder.apply_to_scratch(opp_saved);
+        return result;
+    }
+
+    // The score of the joint move in moves_scratch.
+    float pure_score_on_scratch() const {
+        return score(
+            our_encoder.encode_scratch(), opp_encoder.encode_scratch());
+    }
+
     float score_on_scratch(bool our) const {
         if (our) {
-            int e = our_encoder.encode(our_encoder.read_from_scratch());
-            return our_mix_scores[e] / our_mix_count;
+            int e = our_encoder.encode_scratch();
+            if (dense)
+                return our_mix_scores[e] / our_mix_count;
+            float result = 0;
+            for (auto kv : opp_played)
+                result += kv.second * score(e, kv.first);
+            return result / our_mix_count;
         } else {
-            int e = opp_encoder.encode(opp_encoder.read_from_scratch());
-            return -opp_mix_scores[e] / opp_mix_count;
+            int e = opp_encoder.encode_scratch();
+            if (dense)
+                return -opp_mix_scores[e] / opp_mix_count;
+            float result = 0;
+            for (auto kv : our_played)
+                result += kv.second * score(kv.first, e);
+            return -result / opp_mix_count;
         }
     }
 
+    // Forgets the mixed strategies, prior included.
+    void clear_mixes() {
+        fill(begin(our_mix_scores), end(our_mix_scores), 0.0f);
+        fill(begin(opp_mix_scores), end(opp_mix_scores), 0.0f);
+        our_mix_count = 0;
+        opp_mix_count = 0;
+        our_played.clear();
+        opp_played.clear();
+    }
+
     void update_mix_from_scratch(bool our) {
         if (our) {
-            int e = our_encoder.encode(our_encoder.read_from_scratch());
+            int e = our_encoder.encode_scratch();
             opp_mix_count++;
+            if (!dense) {
+                our_played[e]++;
+                return;
+            }
             for (int i = 0; i < opp_encoder.range; i++)
                 opp_mix_scores[i] += score_matrix[e + i * our_encoder.range];
         } else {
-            int e = opp_encoder.encode(opp_encoder.read_from_scratch());
+            int e = opp_encoder.encode_scratch();
             our_mix_count++;
+            if (!dense) {
+                opp_played[e]++;
+                return;
+            }
             for (int i = 0; i < our_encoder.range; i++)
                 our_mix_scores[i] += score_matrix[i + e * our_encoder.range];
         }
@@ -801,242 +2093,1558 @@ array<int, 5> move_classes(Loc center, Loc p) {
     return result;
 }
 
-map<Loc, DiamondInfo> precompute_diamonds(
+// Reconstructs opponents' moves from consecutive frames and keeps
+// per-opponent statistics of what they do in a given combat context.
+//
+// Moves are recovered by inverting the turn resolution: starting from all
+// opponent pieces standing still, each piece in turn takes the move under
+// which simulate_diamond on the previous board best reproduces the cells of
+// the new frame around it. Our own moves are known exactly.
+//
+// Moves an opponent (almost) never makes in a context are then excluded
+// from the combat search, which shrinks opp_encoder.range.
+class OpponentHistory {
+public:
+    // Call right before sending our moves.
+    void remember(const map<Loc, Dir> &our_moves) {
+        prev_owner = ::owner;
+        prev_strength = ::strength;
+        prev_moves = vector<Dir>(area, Dir::still);
+        for (auto kv : our_moves)
+            prev_moves[kv.first] = kv.second;
+    }
+
+    // Call on the new frame, after init_globals(), with the frame's delta
+    // to the remembered one.
+    void observe(const hlt::FrameDelta &delta) {
+        auto before = pruned_categories();
+        for (int player : delta.eliminated)
+            stats.erase(player);
+        reconstruct(delta);
+        if (pruned_categories() != before)
+            version++;
+    }
+
+    // Moves worth considering for an opponent piece on the current board.
+    vector<Dir> candidate_moves(Loc p) const {
+        vector<Dir> result;
+        int c = context(p);
+        auto it = stats.find(owner[p]);
+        for (int i = 0; i < 5; i++) {
+            Dir d = (Dir)i;
+            if (d != Dir::still && c >= 0 && it != stats.end() &&
+                pruned(it->second[c], category(p, d)))
+                continue;
+            result.push_back(d);
+        }
+        return result;
+    }
+
+    // Like move_classes(), but moves the opponent won't make share the
+    // class of Dir::still.
+    array<int, 5> opp_move_classes(Loc center, Loc p) const {
+        auto result = move_classes(center, p);
+        auto allowed = candidate_moves(p);
+        for (int i = 1; i < 5; i++)
+            if (find(begin(allowed), end(allowed), (Dir)i) == end(allowed))
+                result[i] = result[0];
+        return result;
+    }
+
+    // Bumped whenever candidate_moves() may answer differently for the
+    // same board, i.e. when a category gets pruned or unpruned.
+    int version = 0;
+
+private:
+    static const int MIN_SAMPLES = 20;
+
+    static bool pruned(const array<int, 4> &counts, int category) {
+        int total = accumulate(begin(counts), end(counts), 0);
+        return total >= MIN_SAMPLES && counts[category] * 20 < total;
+    }
+
+    // Per player, bit 4 * context + category for every pruned category.
+    map<int, unsigned> pruned_categories() const {
+        map<int, unsigned> result;
+        for (const auto &kv : stats) {
+            unsigned bits = 0;
+            for (int c = 0; c < 6; c++)
+                for (int category = 1; category < 4; category++)
+                    if (pruned(kv.second[c], category))
+                        bits |= 1u << (4 * c + category);
+            if (bits)
+                result[kv.first] = bits;
+        }
+        return result;
+    }
+
+    // Finds the previous moves of the opponents and counts them.
+    void reconstruct(const hlt::FrameDelta &delta) {
+        if ((int)prev_owner.size() != area)
+            return;
+        vector<int> next_owner = ::owner;
+        vector<int> next_strength = ::strength;
+        swap(::owner, prev_owner);
+        swap(::strength, prev_strength);
+
+        // Pieces further out influence the diamonds around combat pieces
+        // too, so they are reconstructed as well (but not counted).
+        auto combat_pieces = list_opp_combat_pieces();
+        TurnSet<Loc> pieces_set;
+        for (Loc p : combat_pieces)
+            for (Loc n : enumerate_neighborhood(p, 2))
+                if (owner[n] && owner[n] != myID)
+                    pieces_set.insert(n);
+        TurnVector<Loc> pieces(begin(pieces_set), end(pieces_set));
+
+        // A piece whose cell only grew by its production stood still, so
+        // only the pieces on changed cells are searched.
+        TurnVector<bool> changed(area, false);
+        for (int i : delta.ownerChanged)
+            changed[Loc::pack(i % width, i / width)] = true;
+        for (int i : delta.strengthChanged)
+            changed[Loc::pack(i % width, i / width)] = true;
+
+        auto get_move = [this](Loc p) { return prev_moves[p]; };
+        auto mismatches = [&](Loc p) {
+            int result = 0;
+            for (Loc n : enumerate_neighborhood(p, 2)) {
+                auto outcome = simulate_diamond(n, get_move);
+                if (outcome.owner != next_owner[n] ||
+                    outcome.strength != next_strength[n])
+                    result++;
+            }
+            return result;
+        };
+
+        for (int pass = 0; pass < 2; pass++) {
+            for (Loc p : pieces) {
+                if (!changed[p])
+                    continue;
+                Dir best_move = prev_moves[p];
+                int best = mismatches(p);
+                for (int i = 0; i < 5; i++) {
+                    prev_moves[p] = (Dir)i;
+                    int m = mismatches(p);
+                    if (m < best) {
+                        best = m;
+                        best_move = (Dir)i;
+                    }
+                }
+                prev_moves[p] = best_move;
+            }
+        }
+
+        // Only count moves that explain their surroundings exactly.
+        int explained = 0;
+        for (Loc p : combat_pieces) {
+            if (strength[p] > 0 && mismatches(p) == 0) {
+                explained++;
+                int c = context(p);
+                if (c >= 0)
+                    stats[owner[p]][c][category(p, prev_moves[p])]++;
+            }
+        }
+        debug2(combat_pieces.size(), explained);
+
+        ::owner = move(next_owner);
+        ::strength = move(next_strength);
+        prev_owner.clear();
+    }
+
+    // 0: still, 1: toward us, 2: sideways, 3: away from us
+    int category(Loc p, Dir d) const {
+        if (d == Dir::still)
+            return 0;
+        int before = distance_to_us(p);
+        int after = distance_to_us(move_dst(p, d));
+        if (after < before)
+            return 1;
+        return after == before ? 2 : 3;
+    }
+
+    // Distance to our territory (1..3) and whether the piece is at least as
+    // strong as our strongest piece nearby; -1 if we are too far.
+    int context(Loc p) const {
+        int d = distance_to_us(p);
+        if (d > 3)
+            return -1;
+        int our_max = 0;
+        for (Loc n : enumerate_neighborhood(p, 2))
+            if (owner[n] == myID)
+                our_max = max(our_max, strength[n]);
+        return (d - 1) * 2 + (strength[p] >= our_max ? 1 : 0);
+    }
+
+    static int distance_to_us(Loc p) {
+        int result = 1000;
+        for (Loc n : enumerate_neighborhood(p, 4))
+            if (owner[n] == myID)
+                result = min(result, dist(p, n));
+        return result;
+    }
+
+    vector<int> prev_owner;
+    vector<int> prev_strength;
+    vector<Dir> prev_moves;
+    map<int, array<array<int, 4>, 6>> stats;
+};
+
+GAME_LOCAL OpponentHistory opponent_history;
+
+
+// The previous turn's combat solution, to start this turn's from. Pieces
+// are keyed by where their move took them (ours) or was expected to take
+// them (opponents'), with how often each move was a best response.
+struct CombatMemory {
+    // How much each move was played (the average strategy, unnormalized).
+    map<Loc, array<float, 5>> our_counts;
+    map<Loc, array<float, 5>> opp_counts;
+
+    static Dir most_played(const array<float, 5> &counts) {
+        return (Dir)(max_element(begin(counts), end(counts)) -
+                     begin(counts));
+    }
+
+    // Dir::still for a piece that was not in combat.
+    Dir start_move(Loc p, bool our) const {
+        const auto &counts = our ? our_counts : opp_counts;
+        auto it = counts.find(p);
+        return it == counts.end() ? Dir::still : most_played(it->second);
+    }
+
+    void remember(
+        Loc p, Dir move, const array<float, 5> &counts, bool our) {
+        Loc dst = move == Dir::still ? p : move_dst(p, move);
+        (our ? our_counts : opp_counts)[dst] = counts;
+    }
+};
+
+GAME_LOCAL CombatMemory combat_memory;
+
+
+// Score matrix entries allowed per turn (4 bytes each); diamonds beyond
+// that are evaluated lazily.
+const long long DIAMOND_MATRIX_BUDGET = 1 << 22;
+
+// Everything the combat solver needs, laid out once per turn:
+// diamonds in a dense array and the piece-diamond incidence in compressed
+// sparse row form, so the loop itself runs over contiguous indices.
+struct DiamondGraph {
+    vector<DiamondInfo> diamonds;  // ordered by center
+
+    // Our combat pieces, then the opponents'.
+    vector<Loc> pieces;
+    int num_our_pieces = 0;
+
+    // Diamonds whose encoders include pieces[i] are
+    // piece_diamonds[piece_start[i]] .. piece_diamonds[piece_start[i + 1] - 1].
+    vector<int> piece_start;
+    vector<int> piece_diamonds;
+
+    // Moves tried for pieces[i], same layout.
+    vector<int> candidate_start;
+    vector<Dir> candidates;
+
+    // Where the descent for pieces[i] starts: the side's last best
+    // response, initially the previous turn's move (see warm_start()).
+    vector<Dir> start_moves;
+    // Regret matching state of pieces[i], indexed by move: the clipped
+    // cumulative regrets, and the sum of its strategies over the
+    // iterations (weighted by iteration, as usual with regret matching+).
+    vector<array<float, 5>> regrets;
+    vector<array<float, 5>> strategy_sums;
+};
+
+DiamondGraph precompute_diamonds(
     const vector<Loc> &our_combat_pieces,
     const vector<Loc> &opp_combat_pieces) {
 
-    map<Loc, DiamondInfo> diamonds;
-    int cnt = 0;
+    DiamondGraph graph;
+    graph.pieces = our_combat_pieces;
+    graph.pieces.insert(
+        end(graph.pieces),
+        begin(opp_combat_pieces), end(opp_combat_pieces));
+    graph.num_our_pieces = our_combat_pieces.size();
+
+    // 1: ours, 2: opponent's
+    TurnVector<int> side(area, 0);
+    TurnVector<char> near_piece(area, false);
+    for (int i = 0; i < (int)graph.pieces.size(); i++) {
+        Loc p = graph.pieces[i];
+        side[p] = i < graph.num_our_pieces ? 1 : 2;
+        for (Loc n : enumerate_neighborhood(p, 2))
+            near_piece[n] = true;
+    }
+
     for (Loc p = 0; p < area; p++) {
-        vector<Loc> our_pieces;
-        vector<Loc> opp_pieces;
+        if (!near_piece[p])
+            continue;
+        if (cancel_requested())
+            return graph;
+        graph.diamonds.emplace_back();
+        auto &di = graph.diamonds.back();
+        di.center = p;
         for (Loc n : enumerate_neighborhood(p, 2)) {
-            if (binary_search(
-                    begin(our_combat_pieces), end(our_combat_pieces), n))
-                our_pieces.push_back(n);
-            if (binary_search(
-                    begin(opp_combat_pieces), end(opp_combat_pieces), n))
-                opp_pieces.push_back(n);
-        }
-        if (!our_pieces.empty() || !opp_pieces.empty()) {
-            auto &di = diamonds[p] = DiamondInfo();
-            di.center = p;
-            for (Loc n : our_pieces)
+            if (side[n] == 1)
                 di.our_encoder.add(n, move_classes(p, n));
-            for (Loc n : opp_pieces)
-                di.opp_encoder.add(n, move_classes(p, n));
-
-            cnt += di.our_encoder.range * di.opp_encoder.range;
-
-            di.score_matrix.resize(di.our_encoder.range * di.opp_encoder.range);
-            for (int opp_offset = 0;
-                 opp_offset < di.opp_encoder.range;
-                 opp_offset++) {
-                vector<Dir> opp_rep =
-                    di.opp_encoder.decode_representative(opp_offset);
-                di.opp_encoder.apply_to_scratch(opp_rep);
-                for (int our_offset = 0;
-                     our_offset < di.our_encoder.range;
-                     our_offset++) {
-                    // TODO: only decode once for efficiency
-                    vector<Dir> our_rep =
-                        di.our_encoder.decode_representative(our_offset);
-                    di.our_encoder.apply_to_scratch(our_rep);
-
-                    di.score_matrix[
-                        our_offset + di.our_encoder.range * opp_offset] =
-                        simulate_diamond(di.center, get_move_scratch)
-                        .evaluate(di.center);
-                }
-            }
+            else if (side[n] == 2)
+                di.opp_encoder.add(
+                    n, opponent_history.opp_move_classes(p, n));
+        }
+    }
 
-            copy(begin(di.score_matrix),
-                 begin(di.score_matrix) + di.our_encoder.range,
-                 back_inserter(di.our_mix_scores));
-            di.our_mix_count = 1;
+    // Smallest diamonds get dense matrices first.
+    TurnVector<int> by_size(graph.diamonds.size());
+    iota(begin(by_size), end(by_size), 0);
+    sort(begin(by_size), end(by_size), [&graph](int i, int j) {
+        return graph.diamonds[i].size() < graph.diamonds[j].size();
+    });
+    long long budget = DIAMOND_MATRIX_BUDGET;
+    for (int d : by_size) {
+        auto &di = graph.diamonds[d];
+        di.dense = di.size() <= budget;
+        if (di.dense)
+            budget -= di.size();
+    }
 
-            di.opp_mix_scores = vector<float>(di.opp_encoder.range, 0.0f);
+    long long cnt = 0;
+    int num_lazy = 0;
+    for (auto &di : graph.diamonds) {
+        if (cancel_requested())
+            return graph;
+        if (!di.dense) {
+            num_lazy++;
+            di.opp_played[0] = 1;
+            di.our_mix_count = 1;
             di.opp_mix_count = 0;
+            continue;
+        }
+        cnt += di.size();
+
+        di.score_matrix.resize(di.size());
+        for (int opp_offset = 0;
+             opp_offset < di.opp_encoder.range;
+             opp_offset++) {
+            if (cancel_requested())
+                return graph;
+            auto opp_rep =
+                di.opp_encoder.decode_representative(opp_offset);
+            di.opp_encoder.apply_to_scratch(opp_rep);
+            for (int our_offset = 0;
+                 our_offset < di.our_encoder.range;
+                 our_offset++) {
+                // TODO: only decode once for efficiency
+                auto our_rep =
+                    di.our_encoder.decode_representative(our_offset);
+                di.our_encoder.apply_to_scratch(our_rep);
+
+                di.score_matrix[
+                    our_offset + di.our_encoder.range * opp_offset] =
+                    simulate_diamond(di.center, get_move_scratch)
+                    .evaluate(di.center);
+            }
         }
+
+        copy(begin(di.score_matrix),
+             begin(di.score_matrix) + di.our_encoder.range,
+             back_inserter(di.our_mix_scores));
+        di.our_mix_count = 1;
+
+        di.opp_mix_scores = vector<float>(di.opp_encoder.range, 0.0f);
+        di.opp_mix_count = 0;
+    }
+    debug2(cnt, num_lazy);
+
+    // Encoders are in neighborhood order, so list diamonds per piece with a
+    // counting pass first.
+    TurnVector<int> piece_index(area, -1);
+    for (int i = 0; i < (int)graph.pieces.size(); i++)
+        piece_index[graph.pieces[i]] = i;
+    graph.piece_start.assign(graph.pieces.size() + 1, 0);
+    for (const auto &di : graph.diamonds)
+        for (const auto *e : {&di.our_encoder, &di.opp_encoder})
+            for (const auto &off : e->offsets)
+                graph.piece_start[piece_index[off.first] + 1]++;
+    for (int i = 0; i < (int)graph.pieces.size(); i++)
+        graph.piece_start[i + 1] += graph.piece_start[i];
+    graph.piece_diamonds.resize(graph.piece_start.back());
+    TurnVector<int> fill(
+        begin(graph.piece_start), end(graph.piece_start) - 1);
+    for (int d = 0; d < (int)graph.diamonds.size(); d++) {
+        const auto &di = graph.diamonds[d];
+        for (const auto *e : {&di.our_encoder, &di.opp_encoder})
+            for (const auto &off : e->offsets)
+                graph.piece_diamonds[fill[piece_index[off.first]]++] = d;
     }
-    debug(cnt);
 
-    return diamonds;
-}
+    for (int i = 0; i < (int)graph.pieces.size(); i++) {
+        graph.candidate_start.push_back(graph.candidates.size());
+        if (i < graph.num_our_pieces) {
+            graph.candidates.push_back(Dir::still);
+            graph.candidates.insert(
+                end(graph.candidates), begin(all_moves), end(all_moves));
+        } else {
+            auto c = opponent_history.candidate_moves(graph.pieces[i]);
+            graph.candidates.insert(end(graph.candidates), begin(c), end(c));
+        }
+    }
+    graph.candidate_start.push_back(graph.candidates.size());
+    graph.start_moves.assign(graph.pieces.size(), Dir::still);
+    graph.regrets.assign(graph.pieces.size(), array<float, 5>{});
+    graph.strategy_sums.assign(graph.pieces.size(), array<float, 5>{});
 
+    return graph;
+}
 
-map<Loc, Dir> optimize_diamonds(
-    map<Loc, DiamondInfo> &diamonds,
-    const vector<Loc> &pieces,
-    bool our) {
 
-    map<Loc, vector<Loc>> affected_diamonds;
-    for (const auto &kv : diamonds) {
-        const auto &di = kv.second;
-        for (Loc p : di.enumerate_affected())
-            affected_diamonds[p].push_back(di.center);
+// Starts the pieces that were in combat last turn from their most played
+// move: regret matching starts out playing it, and the descents start
+// from it. Also replaces the prior of the mixed strategies (one play of
+// the opponents' representative 0) with one play of each side's start
+// moves in the diamonds around them, for when regret_matching() gets no
+// iteration. The rest of the graph is left alone.
+const float WARM_START_REGRET = 1.0f;
+
+void warm_start(DiamondGraph &graph) {
+    bool any = false;
+    for (int i = 0; i < (int)graph.pieces.size(); i++) {
+        Loc p = graph.pieces[i];
+        Dir d = combat_memory.start_move(p, i < graph.num_our_pieces);
+        auto first = begin(graph.candidates) + graph.candidate_start[i];
+        auto last = begin(graph.candidates) + graph.candidate_start[i + 1];
+        if (d == Dir::still || find(first, last, d) == last)
+            continue;
+        graph.start_moves[i] = d;
+        graph.regrets[i][(int)d] = WARM_START_REGRET;
+        moves_scratch[p] = d;
+        any = true;
+    }
+    if (!any)
+        return;
+
+    TurnVector<char> warm(area, false);
+    for (int i = 0; i < (int)graph.pieces.size(); i++)
+        if (graph.start_moves[i] != Dir::still)
+            warm[graph.pieces[i]] = true;
+    int num_warm = 0;
+    for (auto &di : graph.diamonds) {
+        bool touched = false;
+        for (const auto *e : {&di.our_encoder, &di.opp_encoder})
+            for (const auto &off : e->offsets)
+                touched |= (bool)warm[off.first];
+        if (!touched)
+            continue;
+        num_warm++;
+        int our_e = di.our_encoder.encode_scratch();
+        int opp_e = di.opp_encoder.encode_scratch();
+        di.opp_mix_count = 1;
+        if (!di.dense) {
+            di.opp_played = {{opp_e, 1}};
+            di.our_played = {{our_e, 1}};
+            continue;
+        }
+        int range = di.our_encoder.range;
+        for (int i = 0; i < range; i++)
+            di.our_mix_scores[i] = di.score_matrix[i + range * opp_e];
+        di.opp_mix_scores.resize(di.opp_encoder.range);
+        for (int j = 0; j < di.opp_encoder.range; j++)
+            di.opp_mix_scores[j] = di.score_matrix[our_e + range * j];
     }
+    debug2(num_warm, graph.diamonds.size());
+}
 
-    for (Loc p : pieces)
-        moves_scratch[p] = Dir::still;
+
+// One side's best response to the other side's mixed strategy (the joint
+// moves recorded in the diamonds' mixes), by coordinate descent over its
+// pieces from graph.start_moves, stopping early once a sweep changes
+// nothing. Leaves the moves in moves_scratch and graph.start_moves and
+// returns their score for that side.
+float optimize_diamonds(DiamondGraph &graph, bool our) {
+    int first = our ? 0 : graph.num_our_pieces;
+    int last = our ? graph.num_our_pieces : graph.pieces.size();
+    auto &diamonds = graph.diamonds;
+
+    for (int i = first; i < last; i++)
+        moves_scratch[graph.pieces[i]] = graph.start_moves[i];
 
     float base_score = 0;
-    for (const auto &kv : diamonds)
-        base_score += kv.second.score_on_scratch(our);
-
-    vector<vector<Loc>> improvement_groups;
-    for (Loc p : pieces)
-        improvement_groups.push_back({p});
-
-    for (int step = 0; step < 3; step++) {
-        for (const auto &group : improvement_groups) {
-            set<Loc> touched_diamonds;
-            for (Loc p : group)
-                touched_diamonds.insert(
-                    begin(affected_diamonds[p]),
-                    end(affected_diamonds[p]));
-
-            vector<vector<Dir>> choices(
-                group.size(),
-                {Dir::still, Dir::north, Dir::east, Dir::south, Dir::west});
-            auto combinations = cartesian_product(choices);
-
-            vector<Dir> best_combination;
+    for (const auto &di : diamonds)
+        base_score += di.score_on_scratch(our);
+
+    bool changed = true;
+    for (int step = 0; step < params.descent_steps && changed; step++) {
+        changed = false;
+        for (int i = first; i < last; i++) {
+            Loc p = graph.pieces[i];
+            Dir best_move = Dir::still;
             float best_score = -1e30;
-            for (const auto &combination : combinations) {
-                for (int i = 0; i < (int)group.size(); i++)
-                    moves_scratch[group[i]] = combination[i];
+            for (int c = graph.candidate_start[i];
+                 c < graph.candidate_start[i + 1]; c++) {
+                moves_scratch[p] = graph.candidates[c];
                 float score = 0;
-                for (Loc td : touched_diamonds) {
-                    score += diamonds.at(td).score_on_scratch(our);
-                }
+                for (int j = graph.piece_start[i];
+                     j < graph.piece_start[i + 1]; j++)
+                    score += diamonds[graph.piece_diamonds[j]]
+                        .score_on_scratch(our);
                 //debug2(score, best_score);
                 if (score > best_score) {
                     best_score = score;
-                    best_combination = combination;
+                    best_move = graph.candidates[c];
                 }
             }
-            assert(best_combination.size() == group.size());
-            for (int i = 0; i < (int)group.size(); i++)
-                moves_scratch[group[i]] = best_combination[i];
+            moves_scratch[p] = best_move;
+            if (best_move != graph.start_moves[i]) {
+                graph.start_moves[i] = best_move;
+                changed = true;
+            }
         }
     }
-
     float final_score = 0;
-    for (const auto &kv : diamonds)
-        final_score += kv.second.score_on_scratch(our);
+    for (const auto &di : diamonds)
+        final_score += di.score_on_scratch(our);
 
     debug3(our, base_score, final_score);
-
-    map<Loc, Dir> result;
-    for (Loc p : pieces)
-        if (moves_scratch[p] != Dir::still)
-            result[p] = moves_scratch[p];
-    debug(result);
-
-    for (auto &kv : diamonds)
-        kv.second.update_mix_from_scratch(our);
-
-    return result;
+    return final_score;
 }
 
 
+// Coordinate descent from last turn's moves, until a pass changes nothing.
 map<Loc, Dir> generate_combat_moves(const vector<Loc> &combat_pieces) {
     map<Loc, Dir> result;
-    for (Loc p : combat_pieces)
-        result[p] = Dir::still;
+    for (Loc p : combat_pieces) {
+        result[p] = combat_memory.start_move(p, true);
+        moves_scratch[p] = result[p];
+    }
 
-    for (int pass = 0; pass < 3; pass++) {
+    const vector<vector<Dir>> candidates {
+        {Dir::still}, {Dir::north}, {Dir::east}, {Dir::south}, {Dir::west}};
+    bool changed = true;
+    for (int pass = 0; pass < params.combat_passes && changed; pass++) {
+        changed = false;
         for (auto p : combat_pieces) {
-            auto ns = enumerate_neighborhood(p, 2);
-
-            moves_scratch[p] = Dir::still;
+            auto scores = evaluate_candidates({p}, candidates);
             Dir best_move = Dir::still;
-            int best_score = 0;
-            for (Loc n : ns)
-                best_score += simulate_diamond(n, get_move_scratch).evaluate(n);
-
-            for (Dir d : all_moves) {
-                moves_scratch[p] = d;
-                int score = 0;
-                for (Loc n : ns)
-                    score += simulate_diamond(n, get_move_scratch).evaluate(n);
-                if (score > best_score) {
-                    //debug2(score, best_score);
-                    best_score = score;
-                    best_move = d;
+            float best_score = scores[0];
+            for (int i = 1; i < 5; i++) {
+                if (scores[i] > best_score) {
+                    //debug2(scores[i], best_score);
+                    best_score = scores[i];
+                    best_move = candidates[i][0];
                 }
             }
             moves_scratch[p] = best_move;
+            changed |= result[p] != best_move;
             result[p] = best_move;
         }
     }
 
+    combat_memory = CombatMemory();
+    for (auto kv : result) {
+        array<float, 5> counts {};
+        counts[(int)kv.second] = 1;
+        combat_memory.remember(kv.first, kv.second, counts, true);
+    }
     return result;
 }
 
 
-int main(int argc, char *argv[]) {
-    if (argc > 1 && argv[1] == string("test")) {
-        return test_simulate_diamond();
+// Regret matching+ between our and the opponents' combat pieces over the
+// precomputed diamonds, with every piece a player of its own (a joint
+// strategy of a side would be exponential in its pieces). A piece's payoff
+// is the score, for its side, of the diamonds it is in.
+//
+// The current strategy of a piece plays its candidate moves in proportion
+// to their positive regrets (uniformly when there are none). An iteration
+// samples one joint move from the current strategies; then every piece
+// adds, for each candidate, how much better that move would have done
+// against the others' sampled moves than its strategy did on average, and
+// clips the regrets at zero. Sampling the others (external sampling)
+// keeps an iteration to one pass over the pieces' diamonds instead of a
+// sum over the joint moves of each diamond.
+void regret_matching_step(DiamondGraph &graph, mt19937 &rng, int iteration) {
+    int n = graph.pieces.size();
+    TurnVector<array<float, 5>> strategies(n);
+    for (int i = 0; i < n; i++) {
+        auto &strategy = strategies[i];
+        strategy.fill(0.0f);
+        float total = 0;
+        for (int c = graph.candidate_start[i];
+             c < graph.candidate_start[i + 1]; c++) {
+            int m = (int)graph.candidates[c];
+            strategy[m] = graph.regrets[i][m];
+            total += strategy[m];
+        }
+        int num_candidates =
+            graph.candidate_start[i + 1] - graph.candidate_start[i];
+        for (int c = graph.candidate_start[i];
+             c < graph.candidate_start[i + 1]; c++) {
+            int m = (int)graph.candidates[c];
+            strategy[m] = total > 0 ? strategy[m] / total
+                                    : 1.0f / num_candidates;
+        }
+        // Sampled by hand: discrete_distribution would allocate.
+        float r = uniform_real_distribution<float>(0.0f, 1.0f)(rng);
+        int m = (int)graph.candidates[graph.candidate_start[i]];
+        for (int c = graph.candidate_start[i];
+             c < graph.candidate_start[i + 1]; c++) {
+            m = (int)graph.candidates[c];
+            r -= strategy[m];
+            if (r < 0)
+                break;
+        }
+        moves_scratch[graph.pieces[i]] = (Dir)m;
     }
 
-    if (argc > 1 && argv[1] == string("experiment"))
-        ::experiment = true;
+    // The sampled joint moves make up the mixes the best responses of the
+    // stopping rule play against.
+    for (auto &di : graph.diamonds) {
+        di.update_mix_from_scratch(true);
+        di.update_mix_from_scratch(false);
+    }
 
-    std::cout.sync_with_stdio(0);
+    // Every piece against the same sample, so the updates are simultaneous.
+    for (int i = 0; i < n; i++) {
+        Loc p = graph.pieces[i];
+        float sign = i < graph.num_our_pieces ? 1.0f : -1.0f;
+        Dir sampled = moves_scratch[p];
+        array<float, 5> utility {};
+        float expected = 0;
+        for (int c = graph.candidate_start[i];
+             c < graph.candidate_start[i + 1]; c++) {
+            int m = (int)graph.candidates[c];
+            moves_scratch[p] = (Dir)m;
+            for (int j = graph.piece_start[i];
+                 j < graph.piece_start[i + 1]; j++)
+                utility[m] += sign * graph.diamonds[graph.piece_diamonds[j]]
+                    .pure_score_on_scratch();
+            expected += strategies[i][m] * utility[m];
+        }
+        moves_scratch[p] = sampled;
+        for (int c = graph.candidate_start[i];
+             c < graph.candidate_start[i + 1]; c++) {
+            int m = (int)graph.candidates[c];
+            auto &regret = graph.regrets[i][m];
+            regret = max(0.0f, regret + utility[m] - expected);
+            graph.strategy_sums[i][m] += iteration * strategies[i][m];
+        }
+    }
+}
+
+// Runs regret matching for at most max_iterations or until the deadline.
+// Every GAP_INTERVAL iterations, our best response to the opponents'
+// average strategy scores an upper bound on the value of the game, theirs
+// to our average a lower bound; play stops once the difference is within
+// params.rm_target_gap per piece. The averages are those of the sampled
+// joint moves alone: the prior of the mixes (see warm_start()) is dropped
+// on the first iteration, as it would bias the gap. The best responses
+// are only local optima (coordinate descent), so the bounds can cross: a
+// negative gap means they are not to be trusted, not that play converged.
+//
+// Our moves are the most played ones of our average strategy; without any
+// iteration, our best response to the prior mix.
+const int GAP_INTERVAL = 4;
+
+map<Loc, Dir> regret_matching(
+    DiamondGraph &graph, int max_iterations,
+    chrono::steady_clock::time_point deadline) {
+    // The same samples every time, so that turns can be replayed.
+    mt19937 rng;
+    float target = params.rm_target_gap * (float)graph.pieces.size();
+    int iterations = 0;
+    float gap = 0;
+    while (iterations < max_iterations &&
+           chrono::steady_clock::now() < deadline) {
+        iterations++;
+        if (iterations == 1)
+            for (auto &di : graph.diamonds)
+                di.clear_mixes();
+        regret_matching_step(graph, rng, iterations);
+        if (iterations % GAP_INTERVAL != 0)
+            continue;
+        float upper = optimize_diamonds(graph, true);
+        float lower = -optimize_diamonds(graph, false);
+        gap = upper - lower;
+        debug2(iterations, gap);
+        if (gap >= 0 && gap <= target)
+            break;
+    }
+    debug3(graph.pieces.size(), iterations, gap);
+    if (iterations == 0)
+        optimize_diamonds(graph, true);
+
+    map<Loc, Dir> result;
+    combat_memory = CombatMemory();
+    for (int i = 0; i < (int)graph.pieces.size(); i++) {
+        Loc p = graph.pieces[i];
+        bool our = i < graph.num_our_pieces;
+        auto counts = graph.strategy_sums[i];
+        if (iterations == 0)
+            counts[(int)graph.start_moves[i]] = 1;
+        Dir d = CombatMemory::most_played(counts);
+        combat_memory.remember(p, d, counts, our);
+        if (our && d != Dir::still)
+            result[p] = d;
+    }
+    debug(result.size());
+    return result;
+}
+
+
+// Moves from several sources for one turn. Where they disagree on a piece
+// the earlier source wins: reinforcement, then capture, then combat.
+map<Loc, Dir> merge_moves(
+    map<Loc, Dir> first, initializer_list<const map<Loc, Dir>*> rest) {
+    for (const auto *source : rest)
+        first.insert(begin(*source), end(*source));
+    return first;
+}
+
+
+// Speculative precomputation.
+//
+// After send_moves() the bot sits in getFrame() until the engine and all
+// opponents are done. Meanwhile a worker thread predicts the next board (our
+// moves as sent, opponents standing still) and runs the turn phases on it.
+// When the real frame arrives, each phase result is reused only if the parts
+// of the board it depends on came out exactly as predicted, so the moves are
+// the same as without speculation. Those parts are kept small (see
+// same_frontier()): opponents hardly ever stand still, so a check over the
+// whole board would almost never let a result through.
+//
+// The worker operates on the globals directly: main() must not touch them
+// between start() and stop().
+class Speculation {
+public:
+    ~Speculation() {
+        stop();
+    }
+
+    void start(const map<Loc, Dir> &our_moves) {
+        assert(!worker.joinable());
+#ifdef HOST
+        // The worker would not see this thread's globals.
+        return;
+#endif
+        vector<Dir> moves(area, Dir::still);
+        for (auto kv : our_moves)
+            moves[kv.first] = kv.second;
+        stage = 0;
+        cancelled = false;
+        worker = thread([this, moves]() {
+            cancel_flag = &cancelled;
+            run(moves);
+        });
+    }
+
+    void stop() {
+        cancelled = true;
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // The following are to be called on the real board, after stop().
+
+    bool reuse_distance_to_border() const {
+        auto &c = counts[DISTANCE];
+        c.turns++;
+        if (stage < 1)
+            return false;
+        c.ready++;
+        if (!same_territory())
+            return false;
+        c.hits++;
+        ::distance_to_border = distance_to_border;
+        return true;
+    }
+
+    // Expects coarse_grid to be built.
+    bool reuse_reinforcement(map<Loc, Dir> &moves) const {
+        auto &c = counts[REINFORCEMENT];
+        c.turns++;
+        if (stage < 2)
+            return false;
+        c.ready++;
+        if (!same_territory() || !same_strength() || !same_frontier())
+            return false;
+        c.hits++;
+        moves = reinforcement_moves;
+        return true;
+    }
+
+    // Capture plans only target neutral cells next to our territory in
+    // selected blocks, so this depends on no more than reinforcement.
+    // Expects coarse_grid to be built.
+    bool reuse_capture(
+        const vector<Loc> &combat_pieces, map<Loc, Dir> &moves) const {
+        auto &c = counts[CAPTURE];
+        c.turns++;
+        if (stage < 3)
+            return false;
+        c.ready++;
+        if (combat_pieces != this->combat_pieces || !same_territory() ||
+            !same_strength() || !same_frontier())
+            return false;
+        c.hits++;
+        moves = capture_moves;
+        return true;
+    }
+
+    // Expects moves_scratch to hold the non-combat moves.
+    bool reuse_diamonds(
+        const vector<Loc> &combat_pieces,
+        const vector<Loc> &opp_combat_pieces,
+        DiamondGraph &diamonds) const {
+        auto &c = counts[DIAMONDS];
+        c.turns++;
+        if (stage < 4)
+            return false;
+        c.ready++;
+        if (opponent_history_version != opponent_history.version ||
+            combat_pieces != this->combat_pieces ||
+            opp_combat_pieces != this->opp_combat_pieces ||
+            moves_scratch != noncombat_moves)
+            return false;
+        for (const auto &di : this->diamonds.diamonds)
+            for (Loc n : enumerate_neighborhood(di.center, 2))
+                if (owner[n] != predicted_owner[n] ||
+                    strength[n] != predicted_strength[n])
+                    return false;
+        c.hits++;
+        diamonds = this->diamonds;
+        return true;
+    }
+
+    // Per phase, over the game: turns it was reused, turns the prediction
+    // had got that far, and turns.
+    string reuse_summary() const {
+        static const char *names[NUM_PHASES] = {
+            "distance", "reinforcement", "capture", "diamonds"};
+        ostringstream out;
+        out << "speculation reused (ready, turns):";
+        for (int i = 0; i < NUM_PHASES; i++)
+            out << " " << names[i] << " " << counts[i].hits << " ("
+                << counts[i].ready << ", " << counts[i].turns << ")";
+        return out.str();
+    }
+
+private:
+    enum Phase {DISTANCE, REINFORCEMENT, CAPTURE, DIAMONDS, NUM_PHASES};
+
+    struct ReuseCounts {
+        int turns = 0;
+        int ready = 0;
+        int hits = 0;
+    };
+    // Each phase is tried by a single task of play_turn(), so the counts
+    // do not race.
+    mutable array<ReuseCounts, NUM_PHASES> counts;
+
+    bool same_territory() const {
+        for (Loc p = 0; p < area; p++)
+            if ((owner[p] == myID) != (predicted_owner[p] == myID))
+                return false;
+        return true;
+    }
+
+    // Our cells' strength.
+    bool same_strength() const {
+        for (Loc p = 0; p < area; p++)
+            if (owner[p] == myID && strength[p] != predicted_strength[p])
+                return false;
+        return true;
+    }
+
+    // What reinforcement and capture see outside our territory: for the
+    // cells next to it (the same cells, given same_territory()) whether
+    // they are neutral, and if so their strength and whether their block
+    // is selected. The rest of the board only counts through the block
+    // selection.
+    bool same_frontier() const {
+        for (Loc p = 0; p < area; p++) {
+            if (owner[p] == myID)
+                continue;
+            bool frontier = false;
+            for (Loc n : neighbors(p))
+                if (owner[n] == myID)
+                    frontier = true;
+            if (!frontier)
+                continue;
+            bool neutral = owner[p] == 0;
+            if (neutral != (predicted_owner[p] == 0))
+                return false;
+            int b = coarse_grid.block_of(p);
+            if (neutral && (strength[p] != predicted_strength[p] ||
+                            coarse_grid.selected[b] != selected_blocks[b]))
+                return false;
+        }
+        return true;
+    }
+
+    void run(const vector<Dir> &moves) {
+        auto get_move = [&moves](Loc p) { return moves[p]; };
+        predicted_owner.resize(area);
+        predicted_strength.resize(area);
+        for_row_bands([&](int, int first_row, int end_row) {
+            for (Loc p = first_row * width; p < end_row * width; p++) {
+                auto outcome = simulate_diamond(p, get_move);
+                predicted_owner[p] = outcome.owner;
+                predicted_strength[p] = outcome.strength;
+            }
+        });
+        ::owner = predicted_owner;
+        ::strength = predicted_strength;
+
+        // A phase may give up half way when cancelled (see
+        // cancel_requested()), so cancellation is checked after each one.
+        if (cancelled) return;
+        precompute();
+        build_coarse_grid();
+        distance_to_border = ::distance_to_border;
+        selected_blocks = coarse_grid.selected;
+        stage = 1;
+
+        if (cancelled) return;
+        combat_pieces = list_our_combat_pieces();
+        reinforcement_moves = generate_reinforcement_moves();
+        if (cancelled) return;
+        stage = 2;
+
+        capture_moves = generate_capture_moves(
+            {begin(combat_pieces), end(combat_pieces)}, gather_trees);
+        if (cancelled) return;
+        stage = 3;
+
+        if (cancelled || !experiment) return;
+        // Last write wins, so in reverse merge_moves() order.
+        noncombat_moves = vector<Dir>(area, Dir::still);
+        for (const auto *ms : {&capture_moves, &reinforcement_moves})
+            for (auto kv : *ms)
+                noncombat_moves[kv.first] = kv.second;
+        ::moves_scratch = noncombat_moves;
+        opponent_history_version = opponent_history.version;
+        opp_combat_pieces = list_opp_combat_pieces();
+        diamonds = precompute_diamonds(combat_pieces, opp_combat_pieces);
+        if (cancelled) return;
+        stage = 4;
+    }
+
+    thread worker;
+    atomic<bool> cancelled {false};
+    int stage = 0;  // number of phases completed on the prediction
+
+    vector<int> predicted_owner;
+    vector<int> predicted_strength;
+    vector<int> distance_to_border;
+    vector<bool> selected_blocks;
+    vector<Loc> combat_pieces;
+    vector<Loc> opp_combat_pieces;
+    map<Loc, Dir> reinforcement_moves;
+    map<Loc, Dir> capture_moves;
+    GatherTreeCache gather_trees;  // for the predicted boards
+    vector<Dir> noncombat_moves;
+    DiamondGraph diamonds;
+    int opponent_history_version = -1;
+};
+
+// The moves for the frame in the globals (after init_globals() and
+// opponent_history.observe()).
+//
+// Board analyses run in parallel, then reinforcement and capture in
+// parallel, on the thread pool. Combat comes last: the diamonds around
+// combat pieces see the other pieces' moves through moves_scratch.
+map<Loc, Dir> play_turn(
+    const Speculation &speculation, int max_rm_iterations,
+    chrono::steady_clock::time_point rm_deadline) {
+    vector<Loc> combat_pieces;
+    vector<Loc> opp_combat_pieces;
+    map<Loc, Dir> reinforcement;
+    map<Loc, Dir> capture;
+
+    TaskGraph graph;
+    int distance = graph.add("distance", [&speculation]() {
+        if (!speculation.reuse_distance_to_border())
+            precompute();
+    });
+    int grid = graph.add("coarse_grid", build_coarse_grid);
+    int pieces = graph.add("combat_pieces", [&]() {
+        combat_pieces = list_our_combat_pieces();
+        if (experiment)
+            opp_combat_pieces = list_opp_combat_pieces();
+    });
+    graph.add("reinforcement", [&]() {
+        if (!speculation.reuse_reinforcement(reinforcement))
+            reinforcement = generate_reinforcement_moves();
+    }, {distance, grid});
+    graph.add("capture", [&]() {
+        if (!speculation.reuse_capture(combat_pieces, capture))
+            capture = generate_capture_moves(
+                {begin(combat_pieces), end(combat_pieces)});
+    }, {distance, grid, pieces});
+    graph.run(thread_pool());
+
+    auto moves = merge_moves(move(reinforcement), {&capture});
+    ::moves_scratch = vector<Dir>(area, Dir::still);
+    for (auto kv : moves)
+        moves_scratch[kv.first] = kv.second;
+
+    if (experiment) {
+        DiamondGraph diamonds;
+        if (!speculation.reuse_diamonds(
+                combat_pieces, opp_combat_pieces, diamonds))
+            diamonds = precompute_diamonds(
+                combat_pieces, opp_combat_pieces);
+        //debug(diamonds.size());
+        warm_start(diamonds);
+        auto combat_moves = regret_matching(
+            diamonds, max_rm_iterations, rm_deadline);
+        moves = merge_moves(move(moves), {&combat_moves});
+    } else {
+        auto combat_moves = generate_combat_moves(combat_pieces);
+        //debug(combat_moves);
+        moves = merge_moves(move(moves), {&combat_moves});
+    }
+
+    if (experiment)
+        opponent_history.remember(moves);
+    return moves;
+}
 
-    hlt::GameMap presentMap;
-    unsigned char myID;
-    getInit(myID, presentMap);
-    ::myID = myID;
-    init_globals(presentMap);
-    precompute();
-    sendInit(experiment ? "exp" : "asdf,");
 
+#ifdef HOST
+// Host mode: one process plays many games at once.
+//
+//   g++ -std=c++11 -O2 -pthread -DHOST MyBot.cpp -o MyBotHost
+//   ./MyBotHost host /tmp/mybot.sock [num_workers] [experiment]
+//
+// Every game is a connection to the unix socket speaking the usual engine
+// protocol; the engine is given "./MyBotHost connect /tmp/mybot.sock" (or
+// socat) as the bot command, which only relays stdin/stdout. One thread
+// reads all connections, complete messages become turns in a queue shared
+// by the workers, earliest deadline first. A turn that only starts in the
+// second half of its budget skips the combat solver's iterations.
+
+typedef chrono::steady_clock HostClock;
+
+const HostClock::duration HOST_INIT_BUDGET = chrono::seconds(15);
+const HostClock::duration HOST_TURN_BUDGET = chrono::milliseconds(1000);
+
+// The GAME_LOCAL globals of a game while it is not being played.
+struct GameContext {
+    int myID = 0;
+    int width = 0;
+    int height = 0;
+    int area = 0;
+    vector<int> production;
+    vector<int> owner;
+    vector<int> strength;
+    hlt::FrameDelta frame_delta;
+    Layout layout;
+    logging::BoardContext log_board {};
+    vector<int> distance_to_border;
+    vector<Dir> moves_scratch;
+    Symmetry symmetry;
+    ProductionField production_field;
+    CoarseGrid coarse_grid;
+    GatherTreeCache gather_tree_cache;
+    OpponentHistory opponent_history;
+    CombatMemory combat_memory;
+    vector<vector<unsigned char>> hlt_productions;
+    int hlt_width = 0;
+    int hlt_height = 0;
+
+    void swap_with_globals() {
+        swap(myID, ::myID);
+        swap(width, ::width);
+        swap(height, ::height);
+        swap(area, ::area);
+        swap(production, ::production);
+        swap(owner, ::owner);
+        swap(strength, ::strength);
+        swap(frame_delta, ::frame_delta);
+        swap(layout, ::layout);
+        swap(log_board, logging::board);
+        swap(distance_to_border, ::distance_to_border);
+        swap(moves_scratch, ::moves_scratch);
+        swap(symmetry, ::symmetry);
+        swap(production_field, ::production_field);
+        swap(coarse_grid, ::coarse_grid);
+        swap(gather_tree_cache, ::gather_tree_cache);
+        swap(opponent_history, ::opponent_history);
+        swap(combat_memory, ::combat_memory);
+        swap(hlt_productions, detail::productions);
+        swap(hlt_width, detail::width);
+        swap(hlt_height, detail::height);
+    }
+};
+
+bool write_all(int fd, const string &s) {
+    size_t done = 0;
+    while (done < s.size()) {
+        ssize_t n = send(fd, s.data() + done, s.size() - done, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+struct HostedGame {
+    explicit HostedGame(int fd, int id) : fd(fd), id(id) {}
+    ~HostedGame() {
+        debug3(id, turns, late_turns);
+        close(fd);
+    }
+
+    const int fd;
+    const int id;
+
+    // Reading thread only.
+    string buffer;
+    int lines_received = 0;
+
+    // Complete lines, from the reading thread to the workers.
+    mutex inbox_mutex;
+    deque<string> inbox;
+
+    // Held by the worker playing this game; the rest is only touched
+    // under it.
+    mutex turn_mutex;
+    GameContext context;
+    bool initialized = false;
+    hlt::GameMap game_map;  // the last frame, parsed over by the next
     mt19937 engine;
-    discrete_distribution<int> random_move {8, 2, 1, 0, 0};
+    uniform_int_distribution<int> num_rm_iterations {
+        params.rm_iterations_min, params.rm_iterations_max};
+    int turns = 0;
+    int late_turns = 0;
+};
+
+struct HostTurn {
+    HostClock::time_point deadline;
+    long long seq;
+    shared_ptr<HostedGame> game;
+
+    // priority_queue puts the largest first.
+    bool operator<(const HostTurn &other) const {
+        return tie(other.deadline, other.seq) < tie(deadline, seq);
+    }
+};
+
+class Host {
+public:
+    Host(const string &path, int num_workers) {
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        if (listen_fd < 0 || path.size() >= sizeof(addr.sun_path)) {
+            cerr << "can't create socket " << path << endl;
+            exit(1);
+        }
+        strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+        if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, 64) != 0) {
+            cerr << "can't listen on " << path << endl;
+            exit(1);
+        }
+        for (int i = 0; i < num_workers; i++)
+            workers.emplace_back([this]() { work(); });
+    }
+
+    void run() {
+        while (true) {
+            vector<pollfd> fds {{listen_fd, POLLIN, 0}};
+            for (auto kv : games)
+                fds.push_back({kv.first, POLLIN, 0});
+            if (poll(fds.data(), fds.size(), -1) < 0)
+                continue;
+            for (auto &pfd : fds) {
+                if (!pfd.revents)
+                    continue;
+                if (pfd.fd == listen_fd)
+                    accept_game();
+                else
+                    read_game(pfd.fd);
+            }
+        }
+    }
+
+private:
+    void accept_game() {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            return;
+        games[fd] = make_shared<HostedGame>(fd, next_game_id++);
+    }
+
+    void read_game(int fd) {
+        auto game = games[fd];
+        char chunk[1 << 14];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            // Turns still queued keep the game alive until they are done.
+            games.erase(fd);
+            return;
+        }
+        game->buffer.append(chunk, n);
+        size_t start = 0;
+        size_t end;
+        while ((end = game->buffer.find('\n', start)) != string::npos) {
+            string line = game->buffer.substr(start, end - start);
+            start = end + 1;
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (line.empty())
+                continue;
+            {
+                lock_guard<mutex> lock(game->inbox_mutex);
+                game->inbox.push_back(move(line));
+            }
+            // Init is the first four lines, after that one line per frame.
+            game->lines_received++;
+            if (game->lines_received >= 4) {
+                auto budget = game->lines_received == 4
+                    ? HOST_INIT_BUDGET : HOST_TURN_BUDGET;
+                lock_guard<mutex> lock(queue_mutex);
+                queue.push({HostClock::now() + budget, next_seq++, game});
+                queue_cv.notify_one();
+            }
+        }
+        game->buffer.erase(0, start);
+    }
+
+    void work() {
+        while (true) {
+            HostTurn turn;
+            {
+                unique_lock<mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [this]() { return !queue.empty(); });
+                turn = queue.top();
+                queue.pop();
+            }
+            auto &game = *turn.game;
+            lock_guard<mutex> lock(game.turn_mutex);
+            game.context.swap_with_globals();
+            try {
+                play(game, turn.deadline);
+            } catch (const exception &e) {
+                debug_line(logging::Raw {
+                    "game " + to_string(game.id) + ": " + e.what()});
+                shutdown(game.fd, SHUT_RDWR);
+            }
+            game.context.swap_with_globals();
+        }
+    }
+
+    // Plays whatever complete messages the game has waiting.
+    void play(HostedGame &game, HostClock::time_point deadline) {
+        while (true) {
+            vector<string> lines;
+            {
+                lock_guard<mutex> lock(game.inbox_mutex);
+                size_t needed = game.initialized ? 1 : 4;
+                if (game.inbox.size() < needed)
+                    return;
+                lines.assign(begin(game.inbox), begin(game.inbox) + needed);
+                game.inbox.erase(
+                    begin(game.inbox), begin(game.inbox) + needed);
+            }
+
+            string reply;
+            if (!game.initialized) {
+                ::myID = stoi(lines[0]);
+                detail::deserializeMapSize(lines[1]);
+                detail::deserializeProductions(lines[2]);
+                game.game_map = detail::deserializeMap(lines[3]);
+                init_globals(game.game_map);
+                precompute_static();
+                precompute();
+                game.initialized = true;
+                reply = experiment ? "exp" : "asdf,";
+            } else {
+                bool behind =
+                    HostClock::now() + HOST_TURN_BUDGET / 2 > deadline;
+                int max_rm_iterations =
+                    game.num_rm_iterations(game.engine);
+                auto rm_deadline = min(
+                    deadline - HOST_TURN_BUDGET / 4,
+                    HostClock::now() +
+                        chrono::milliseconds(params.rm_budget_ms));
+                detail::deserializeMap(lines[0], game.game_map, frame_delta);
+                init_globals(game.game_map);
+                if (experiment)
+                    opponent_history.observe(frame_delta);
+                Speculation no_speculation;
+                auto moves = play_turn(
+                    no_speculation, behind ? 0 : max_rm_iterations,
+                    rm_deadline);
+                reply = detail::serializeMoveSet(to_hlt_moves(moves));
+                game.turns++;
+            }
+            arena::turn_arena().release();
+            if (reply.empty())
+                reply = " ";
+            write_all(game.fd, reply + "\n");
+            if (HostClock::now() > deadline)
+                game.late_turns++;
+        }
+    }
 
-    uniform_int_distribution<int> num_brown_iterations(20, 25);
+    int listen_fd;
+    map<int, shared_ptr<HostedGame>> games;  // by fd, reading thread only
+    int next_game_id = 0;
 
+    mutex queue_mutex;
+    condition_variable queue_cv;
+    priority_queue<HostTurn> queue;
+    long long next_seq = 0;
+
+    vector<thread> workers;
+};
+
+// Relays stdin/stdout to a game connection of a host.
+int connect_to_host(const string &path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        cerr << "can't connect to " << path << endl;
+        return 1;
+    }
+    pollfd fds[] = {{0, POLLIN, 0}, {fd, POLLIN, 0}};
+    char chunk[1 << 14];
     while (true) {
-        dbg << "-------------" << endl;
-        getFrame(presentMap);
-        init_globals(presentMap);
-        precompute();
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(0, chunk, sizeof(chunk));
+            if (n <= 0 || !write_all(fd, string(chunk, n)))
+                return 0;
+        }
+        if (fds[1].revents) {
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n <= 0)
+                return 0;
+            for (ssize_t done = 0; done < n;) {
+                ssize_t m = write(1, chunk + done, n - done);
+                if (m <= 0)
+                    return 0;
+                done += m;
+            }
+        }
+    }
+}
+#endif
 
-        auto combat_pieces = list_our_combat_pieces();
 
-        map<Loc, Dir> moves = generate_reinforcement_moves();
-        //debug(moves);
-        auto cap = generate_capture_moves(
-            {begin(combat_pieces), end(combat_pieces)});
-        //debug(cap);
-        moves.insert(begin(cap), end(cap));
+// Swallows the moves sent during a replay.
+struct NullBuffer : public streambuf {
+    int overflow(int c) override {
+        return traits_type::not_eof(c);
+    }
+};
+
+// Summary of the turn latencies and allocations of a replay, on stderr.
+int report_latencies(
+    const vector<long long> &latencies, const vector<long long> &allocations) {
+    if (latencies.empty()) {
+        cerr << "no frames" << endl;
+        return 1;
+    }
+    vector<long long> sorted = latencies;
+    sort(begin(sorted), end(sorted));
+    auto percentile = [&sorted](int q) {
+        return sorted[min(sorted.size() - 1, sorted.size() * q / 100)];
+    };
+    double mean = accumulate(begin(sorted), end(sorted), 0.0) / sorted.size();
+    cerr << sorted.size() << " turns, microseconds:"
+         << " mean " << (long long)mean
+         << " median " << percentile(50)
+         << " p90 " << percentile(90)
+         << " p99 " << percentile(99)
+         << " max " << sorted.back() << endl;
+
+    vector<int> turns(latencies.size());
+    iota(begin(turns), end(turns), 0);
+    sort(begin(turns), end(turns), [&latencies](int a, int b) {
+        return latencies[a] > latencies[b];
+    });
+    cerr << "slowest turns:";
+    for (int i = 0; i < min((int)turns.size(), 10); i++)
+        cerr << " " << turns[i] + 1 << " (" << latencies[turns[i]] << ")";
+    cerr << endl;
+    cerr << "allocations per turn: mean "
+         << accumulate(begin(allocations), end(allocations), 0LL) /
+            (long long)allocations.size()
+         << " max " << *max_element(begin(allocations), end(allocations))
+         << endl;
+    return 0;
+}
 
-        ::moves_scratch = vector<Dir>(area, Dir::still);
-        for (auto kv : moves)
-            moves_scratch[kv.first] = kv.second;
 
-        if (experiment) {
-            auto diamonds = precompute_diamonds(
-                combat_pieces, list_opp_combat_pieces());
-            //debug(diamonds.size());
-            int n = num_brown_iterations(engine);
-            auto combat_moves = optimize_diamonds(diamonds, combat_pieces, true);
-            for (int i = 0; i < n; i++) {
-                optimize_diamonds(diamonds, list_opp_combat_pieces(), false);
-                combat_moves = optimize_diamonds(diamonds, combat_pieces, true);
+#ifndef MYBOT_NO_MAIN
+int main(int argc, char *argv[]) {
+    if (argc > 1 && argv[1] == string("test")) {
+        return test_simulate_diamond();
+    }
+
+    // "experiment" (anywhere) turns on the experimental combat code.
+    // name=value arguments set parameters; timing=<file> records the
+    // microseconds spent on each turn. capture=<file> records the input
+    // with arrival times, replay=<file> plays such a capture back as fast
+    // as possible instead of talking to the engine, then reports turn
+    // latencies.
+    ofstream timing;
+    ofstream capture;
+    ifstream replay;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "experiment")
+            ::experiment = true;
+        size_t eq = arg.find('=');
+        if (eq == string::npos)
+            continue;
+        string name = arg.substr(0, eq);
+        string value = arg.substr(eq + 1);
+        if (name == "timing") {
+            timing.open(value);
+        } else if (name == "capture") {
+            capture.open(value);
+            detail::capture = &capture;
+            detail::captureStart = chrono::steady_clock::now();
+        } else if (name == "replay") {
+            replay.open(value);
+            if (!replay) {
+                cerr << "can't open " << value << endl;
+                return 1;
             }
-            moves.insert(begin(combat_moves), end(combat_moves));
         } else {
-            auto combat_moves = generate_combat_moves(combat_pieces);
-            //debug(combat_moves);
-            moves.insert(begin(combat_moves), end(combat_moves));
+            size_t end = 0;
+            int v = 0;
+            try {
+                v = stoi(value, &end);
+            } catch (const logic_error &) {
+                end = 0;
+            }
+            if (end == 0 || end != value.size()) {
+                cerr << "bad value for parameter " << name << ": "
+                     << value << endl;
+                return 1;
+            }
+            if (!set_param(name, v)) {
+                cerr << "unknown parameter " << name << endl;
+                return 1;
+            }
         }
+    }
+
+#ifdef HOST
+    if (argc > 2 && argv[1] == string("connect"))
+        return connect_to_host(argv[2]);
+    if (argc > 2 && argv[1] == string("host")) {
+        int num_workers = argc > 3
+            ? atoi(argv[3]) : (int)thread::hardware_concurrency();
+        Host(argv[2], max(num_workers, 1)).run();
+        return 0;
+    }
+#endif
 
-        send_moves(moves);
+    std::cout.sync_with_stdio(0);
+
+#ifndef HOST
+    // The main thread is the other one.
+    start_thread_pool(max(0, (int)thread::hardware_concurrency() - 1));
+#endif
+
+    stringstream replay_input;
+    NullBuffer discard;
+    vector<long long> latencies;
+    vector<long long> allocations;
+    if (replay.is_open()) {
+        string line;
+        while (getline(replay, line)) {
+            line = line.substr(line.find('\t') + 1);
+            if (!line.empty())
+                replay_input << line.c_str() << '\n';
+        }
+        cin.rdbuf(replay_input.rdbuf());
+        cout.rdbuf(&discard);
+    }
+
+    // The engine ends the game by closing stdin, a replay by running out of
+    // frames. Anything else that breaks the protocol ends the bot too,
+    // rather than leaving it waiting for input that will never parse.
+    Speculation speculation;
+    try {
+        hlt::GameMap presentMap;
+        unsigned char myID;
+        getInit(myID, presentMap);
+        ::myID = myID;
+        init_globals(presentMap);
+        precompute_static();
+        precompute();
+        sendInit(experiment ? "exp" : "asdf,");
+
+        mt19937 engine;
+        discrete_distribution<int> random_move {8, 2, 1, 0, 0};
+
+        uniform_int_distribution<int> num_rm_iterations(
+            params.rm_iterations_min, params.rm_iterations_max);
+
+        while (true) {
+            debug_line("-------------");
+            getFrame(presentMap, frame_delta);
+            speculation.stop();
+            init_globals(presentMap);
+            for (int player : frame_delta.eliminated)
+                debug(player);
+            if (experiment)
+                opponent_history.observe(frame_delta);
+            auto moves = play_turn(
+                speculation, num_rm_iterations(engine),
+                detail::lastArrival +
+                    chrono::milliseconds(params.rm_budget_ms));
+            send_moves(moves);
+            auto latency = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - detail::lastArrival).count();
+            if (timing)
+                timing << latency << endl;
+            if (replay.is_open())
+                latencies.push_back(latency);
+            // Since the previous turn, on all threads.
+            auto allocation_stats = arena::take_allocation_stats();
+            debug3(allocation_stats.count, allocation_stats.bytes,
+                   arena::turn_arena().used());
+            ostringstream histogram;
+            histogram << "allocations by size (<1, <2, <4, ...):";
+            for (long long h : allocation_stats.histogram)
+                histogram << " " << h;
+            debug_line(logging::Raw {histogram.str()});
+            if (replay.is_open())
+                allocations.push_back(allocation_stats.count);
+            arena::turn_arena().release();
+            thread_pool().release_arenas();
+            speculation.start(moves);
+        }
+    } catch (const hlt::EndOfInput &) {
+        debug_line("end of input");
+        debug_line(logging::Raw {speculation.reuse_summary()});
+        if (replay.is_open()) {
+            cerr << speculation.reuse_summary() << endl;
+            return report_latencies(latencies, allocations);
+        }
+        return 0;
+    } catch (const hlt::ProtocolError &e) {
+        debug_line(logging::Raw {e.what()});
+        cerr << e.what() << endl;
+        return 1;
     }
 
     return 0;
 }
+#endif
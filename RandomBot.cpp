@@ -16,24 +16,31 @@ int main() {
 
     unsigned char myID;
     hlt::GameMap presentMap;
-    getInit(myID, presentMap);
-    sendInit("RandomC++Bot");
-
     std::set<hlt::Move> moves;
-    while(true) {
-        moves.clear();
+    try {
+        getInit(myID, presentMap);
+        sendInit("RandomC++Bot");
+
+        while(true) {
+            moves.clear();
 
-        getFrame(presentMap);
+            getFrame(presentMap);
 
-        for(unsigned short a = 0; a < presentMap.height; a++) {
-            for(unsigned short b = 0; b < presentMap.width; b++) {
-                if (presentMap.getSite({ b, a }).owner == myID) {
-                    moves.insert({ { b, a }, (unsigned char)(rand() % 5) });
+            for(unsigned short a = 0; a < presentMap.height; a++) {
+                for(unsigned short b = 0; b < presentMap.width; b++) {
+                    if (presentMap.getSite({ b, a }).owner == myID) {
+                        moves.insert({ { b, a }, (unsigned char)(rand() % 5) });
+                    }
                 }
             }
-        }
 
-        sendFrame(moves);
+            sendFrame(moves);
+        }
+    } catch(const hlt::EndOfInput &) {
+        return 0;
+    } catch(const hlt::ProtocolError &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
 
     return 0;
@@ -0,0 +1,187 @@
+#pragma once
+
+// Per-turn memory and allocation counting.
+//
+// Short-lived planning containers (neighborhood lists, the forbidden set,
+// visited sets, score buffers) allocate from a monotonic arena: allocation
+// is a pointer bump, deallocation does nothing, and release() at the end of
+// the turn drops everything at once. Containers using TurnAllocator must not
+// outlive the turn (or the thread) they were created in.
+//
+// Separately, every call of the global operator new is counted, with a
+// histogram by size, so allocation regressions show up in the turn logs.
+// This replaces the global operator new: include from one translation unit.
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <new>
+#include <set>
+#include <vector>
+
+
+namespace arena {
+
+// Bucket i counts sizes in [2^(i-1), 2^i), the last one everything larger.
+const int NUM_SIZE_BUCKETS = 16;
+
+struct AllocationCounters {
+    std::atomic<long long> count {0};
+    std::atomic<long long> bytes {0};
+    std::atomic<long long> histogram[NUM_SIZE_BUCKETS];
+
+    AllocationCounters() {
+        for (auto &h : histogram)
+            h.store(0, std::memory_order_relaxed);
+    }
+
+    void add(size_t size) {
+        int bucket = 0;
+        while (bucket < NUM_SIZE_BUCKETS - 1 && ((size_t)1 << bucket) <= size)
+            bucket++;
+        count.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+inline AllocationCounters& allocation_counters() {
+    static AllocationCounters counters;
+    return counters;
+}
+
+// Allocations (all threads) since the previous call.
+struct AllocationStats {
+    long long count = 0;
+    long long bytes = 0;
+    std::vector<long long> histogram;
+};
+
+inline AllocationStats take_allocation_stats() {
+    auto &c = allocation_counters();
+    AllocationStats s;
+    s.count = c.count.exchange(0, std::memory_order_relaxed);
+    s.bytes = c.bytes.exchange(0, std::memory_order_relaxed);
+    for (auto &h : c.histogram)
+        s.histogram.push_back(h.exchange(0, std::memory_order_relaxed));
+    return s;
+}
+
+
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t bytes, size_t align) {
+        size_t pos = (offset + align - 1) & ~(align - 1);
+        if (chunks.empty() || pos + bytes > chunk_size) {
+            // Chunks double, so a turn needs O(log) of them; release()
+            // merges them into one for the next turn.
+            size_t size = std::max(bytes + align, 2 * chunk_size);
+            size = std::max(size, (size_t)MIN_CHUNK);
+            chunks.emplace_back(new char[size]);
+            retired += offset;
+            chunk_size = size;
+            offset = 0;
+            pos = 0;
+        }
+        char *base = chunks.back().get();
+        // operator new[] alignment covers the start of each chunk.
+        offset = pos + bytes;
+        return base + pos;
+    }
+
+    // Frees everything allocated since the last call.
+    void release() {
+        if (chunks.size() > 1) {
+            size_t total = retired + offset;
+            chunks.clear();
+            chunks.emplace_back(new char[total]);
+            chunk_size = total;
+        }
+        retired = 0;
+        offset = 0;
+    }
+
+    size_t used() const { return retired + offset; }
+
+private:
+    static const size_t MIN_CHUNK = 1 << 16;
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunk_size = 0;
+    size_t offset = 0;   // in the last chunk
+    size_t retired = 0;  // used in the previous chunks
+};
+
+// One per thread: the speculation worker and the host workers plan turns
+// of their own.
+inline Arena& turn_arena() {
+    static thread_local Arena instance;
+    return instance;
+}
+
+
+template<typename T>
+struct TurnAllocator {
+    typedef T value_type;
+
+    TurnAllocator() : arena(&turn_arena()) {}
+    template<typename U>
+    TurnAllocator(const TurnAllocator<U> &other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, size_t) {}
+
+    Arena *arena;
+};
+
+template<typename T, typename U>
+bool operator==(const TurnAllocator<T> &a, const TurnAllocator<U> &b) {
+    return a.arena == b.arena;
+}
+
+template<typename T, typename U>
+bool operator!=(const TurnAllocator<T> &a, const TurnAllocator<U> &b) {
+    return a.arena != b.arena;
+}
+
+}  // namespace arena
+
+
+template<typename T>
+using TurnVector = std::vector<T, arena::TurnAllocator<T>>;
+template<typename T>
+using TurnSet = std::set<T, std::less<T>, arena::TurnAllocator<T>>;
+template<typename K, typename V>
+using TurnMap = std::map<K, V, std::less<K>,
+                         arena::TurnAllocator<std::pair<const K, V>>>;
+
+
+void* operator new(size_t size) {
+    arena::allocation_counters().add(size);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+// Not inlined, or GCC pairs the free() with a new-expression at the call
+// site and warns about the mismatch.
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept {
+    std::free(p);
+}
@@ -0,0 +1,312 @@
+// Microbenchmarks for the phases of a turn, on a fixed corpus of frames.
+//
+//   g++ -std=c++11 -O2 -pthread bench.cpp -o bench
+//   ./bench [-w warmup] [-r repetitions] [-n rm_iterations]
+//       [-t tile,tile...] [-j workers] bench_frames/*.txt
+//
+// (or just ./runBench.sh [options]).
+//
+// A corpus file is exactly what the engine sends to player N: the player
+// tag, the map size, the productions, the initial map, and then any number
+// of frames (a capture made with "MyBot capture=<file>" works too). Every
+// frame after the initial map is a benchmark case. For each file and phase
+// the time of one repetition is the sum over its frames;
+// "allocs" counts the calls of operator new in one repetition.
+//
+// -t runs every corpus once per board layout tile size (params.layout_tile,
+// 1 is row-major); rows of other layouts show the corpus as name@tile.
+// -j sets the number of thread pool workers (default: one less than the
+// hardware threads, like the bot; 0 runs everything on the main thread).
+
+#define LOG_LEVEL LOG_LEVEL_OFF
+#define MYBOT_NO_MAIN
+#include "MyBot.cpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+
+
+struct Corpus {
+    string name;
+    int player;
+    vector<string> frames;
+};
+
+Corpus load_corpus(const string &filename) {
+    ifstream fin(filename);
+    if (!fin) {
+        cerr << "can't open " << filename << endl;
+        exit(1);
+    }
+    Corpus c;
+    c.name = filename.substr(filename.find_last_of('/') + 1);
+    vector<string> lines;
+    string line;
+    while (getline(fin, line)) {
+        // Captures (capture=<file>) prefix lines with a timestamp.
+        line = line.substr(line.find('\t') + 1);
+        if (!line.empty())
+            lines.push_back(line);
+    }
+    if (lines.size() < 5) {
+        cerr << filename << ": expected init and at least one frame" << endl;
+        exit(1);
+    }
+    c.player = stoi(lines[0]);
+    detail::deserializeMapSize(lines[1]);
+    detail::deserializeProductions(lines[2]);
+    c.frames.assign(begin(lines) + 4, end(lines));
+    return c;
+}
+
+
+// Sets up globals the way main() does right after getFrame(), with no
+// combat solution to warm-start from.
+void load_frame(hlt::GameMap &game_map) {
+    init_globals(game_map);
+    precompute_static();
+    precompute();
+    build_coarse_grid();
+    moves_scratch = vector<Dir>(area, Dir::still);
+    combat_memory = CombatMemory();
+}
+
+
+struct Stats {
+    double min, median, mean, p90, max, stddev;
+};
+
+Stats summarize(vector<double> xs) {
+    assert(!xs.empty());
+    sort(begin(xs), end(xs));
+    Stats s;
+    s.min = xs.front();
+    s.max = xs.back();
+    s.median = xs[xs.size() / 2];
+    s.p90 = xs[min(xs.size() - 1, xs.size() * 9 / 10)];
+    s.mean = 0;
+    for (double x : xs)
+        s.mean += x;
+    s.mean /= xs.size();
+    s.stddev = 0;
+    for (double x : xs)
+        s.stddev += (x - s.mean) * (x - s.mean);
+    s.stddev = sqrt(s.stddev / xs.size());
+    return s;
+}
+
+
+typedef chrono::steady_clock Clock;
+
+int num_warmup = 3;
+int num_reps = 20;
+int rm_iterations = 22;  // middle of [rm_iterations_min, rm_iterations_max]
+
+// 'setup' runs untimed before each timed 'phase' call, for every frame.
+void bench_phase(
+    const Corpus &corpus, vector<hlt::GameMap> &maps,
+    const string &phase_name,
+    const function<void()> &setup,
+    const function<void()> &phase) {
+    vector<double> samples;
+    long long allocations = 0;
+    for (int rep = -num_warmup; rep < num_reps; rep++) {
+        Clock::duration total {0};
+        for (auto &m : maps) {
+            load_frame(m);
+            setup();
+            arena::take_allocation_stats();
+            auto start = Clock::now();
+            phase();
+            total += Clock::now() - start;
+            if (rep >= 0)
+                allocations += arena::take_allocation_stats().count;
+            arena::turn_arena().release();
+            thread_pool().release_arenas();
+        }
+        if (rep >= 0)
+            samples.push_back(
+                chrono::duration<double, micro>(total).count());
+    }
+    auto s = summarize(samples);
+    cout << left << setw(24) << corpus.name.c_str()
+         << setw(22) << phase_name.c_str() << right
+         << fixed << setprecision(1)
+         << setw(11) << s.median << setw(11) << s.mean
+         << setw(11) << s.min << setw(11) << s.p90 << setw(11) << s.max
+         << setw(9) << s.stddev
+         << setw(10) << allocations / num_reps << endl;
+}
+
+
+void bench_corpus(const Corpus &corpus) {
+    ::myID = corpus.player;
+
+    vector<hlt::GameMap> maps;
+    for (const auto &frame : corpus.frames)
+        maps.push_back(detail::deserializeMap(frame));
+
+    auto nop = []() {};
+
+    hlt::GameMap parsed;
+    int frame_index = 0;
+    bench_phase(corpus, maps, "parse", nop, [&]() {
+        parsed = detail::deserializeMap(
+            corpus.frames[frame_index++ % corpus.frames.size()]);
+        init_globals(parsed);
+    });
+
+    // The same, parsed over the previous frame with its delta.
+    hlt::GameMap previous;
+    hlt::FrameDelta delta;
+    int delta_index = 0;
+    bench_phase(corpus, maps, "parse_delta",
+        [&]() {
+            size_t i = delta_index % maps.size();
+            previous = maps[i ? i - 1 : i];
+        },
+        [&]() {
+            detail::deserializeMap(
+                corpus.frames[delta_index++ % corpus.frames.size()],
+                previous, delta);
+            init_globals(previous);
+        });
+
+    bench_phase(corpus, maps, "precompute", nop, precompute);
+    bench_phase(corpus, maps, "coarse_grid", nop, build_coarse_grid);
+
+    vector<Loc> combat_pieces;
+    vector<Loc> opp_combat_pieces;
+    auto list_pieces = [&]() {
+        combat_pieces = list_our_combat_pieces();
+        opp_combat_pieces = list_opp_combat_pieces();
+    };
+    bench_phase(corpus, maps, "list_combat_pieces", nop, list_pieces);
+
+    map<Loc, Dir> moves;
+    bench_phase(corpus, maps, "reinforcement", nop, [&]() {
+        moves = generate_reinforcement_moves();
+    });
+
+    bench_phase(corpus, maps, "capture", list_pieces, [&]() {
+        moves = generate_capture_moves(
+            {begin(combat_pieces), end(combat_pieces)});
+    });
+
+    bench_phase(corpus, maps, "combat", list_pieces, [&]() {
+        moves = generate_combat_moves(combat_pieces);
+    });
+
+    DiamondGraph diamonds;
+    bench_phase(corpus, maps, "precompute_diamonds", list_pieces, [&]() {
+        diamonds = precompute_diamonds(combat_pieces, opp_combat_pieces);
+    });
+
+    bench_phase(corpus, maps, "optimize_diamonds",
+        [&]() {
+            list_pieces();
+            diamonds = precompute_diamonds(combat_pieces, opp_combat_pieces);
+        },
+        [&]() {
+            moves = regret_matching(
+                diamonds, rm_iterations, Clock::time_point::max());
+        });
+
+    // The same, warm-started from the solution of the previous frame.
+    int warm_index = 0;
+    bench_phase(corpus, maps, "optimize_diamonds_warm",
+        [&]() {
+            size_t i = warm_index++ % maps.size();
+            if (i > 0) {
+                load_frame(maps[i - 1]);
+                list_pieces();
+                diamonds = precompute_diamonds(
+                    combat_pieces, opp_combat_pieces);
+                regret_matching(
+                    diamonds, rm_iterations, Clock::time_point::max());
+                auto memory = combat_memory;
+                load_frame(maps[i]);
+                combat_memory = memory;
+            }
+            list_pieces();
+            diamonds = precompute_diamonds(combat_pieces, opp_combat_pieces);
+            warm_start(diamonds);
+        },
+        [&]() {
+            moves = regret_matching(
+                diamonds, rm_iterations, Clock::time_point::max());
+        });
+
+    // The whole turn as the bot plays it, nothing reused from speculation.
+    Speculation no_speculation;
+    bench_phase(corpus, maps, "turn", nop, [&]() {
+        moves = play_turn(
+            no_speculation, rm_iterations, Clock::time_point::max());
+    });
+
+    string serialized;
+    bench_phase(corpus, maps, "serialize",
+        [&]() {
+            moves = generate_reinforcement_moves();
+        },
+        [&]() {
+            serialized = detail::serializeMoveSet(to_hlt_moves(moves));
+        });
+}
+
+
+int main(int argc, char *argv[]) {
+    vector<string> filenames;
+    vector<int> tiles;
+    int num_workers = max(0, (int)thread::hardware_concurrency() - 1);
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc) {
+            stringstream list(argv[++i]);
+            string tile;
+            while (getline(list, tile, ','))
+                tiles.push_back(atoi(tile.c_str()));
+        } else if (arg == "-j" && i + 1 < argc) {
+            num_workers = atoi(argv[++i]);
+        } else if ((arg == "-w" || arg == "-r" || arg == "-n") &&
+                   i + 1 < argc) {
+            int value = atoi(argv[++i]);
+            if (arg == "-w") num_warmup = value;
+            if (arg == "-r") num_reps = value;
+            if (arg == "-n") rm_iterations = value;
+        } else {
+            filenames.push_back(arg);
+        }
+    }
+    if (tiles.empty())
+        tiles.push_back(params.layout_tile);
+    bool bad_tile = false;
+    for (int t : tiles)
+        bad_tile |= t < 1;
+    if (filenames.empty() || num_reps <= 0 || bad_tile || num_workers < 0) {
+        cerr << "usage: bench [-w warmup] [-r repetitions] "
+             << "[-n rm_iterations] [-t tile,tile...] [-j workers] "
+             << "corpus..." << endl;
+        return 1;
+    }
+    start_thread_pool(num_workers);
+
+    cout << "times in microseconds per repetition, "
+         << num_warmup << " warmup, " << num_reps << " repetitions" << endl;
+    cout << left << setw(24) << "corpus" << setw(22) << "phase" << right
+         << setw(11) << "median" << setw(11) << "mean"
+         << setw(11) << "min" << setw(11) << "p90" << setw(11) << "max"
+         << setw(9) << "stddev" << setw(10) << "allocs" << endl;
+    for (const auto &filename : filenames) {
+        auto corpus = load_corpus(filename);
+        string name = corpus.name;
+        for (int t : tiles) {
+            params.layout_tile = t;
+            corpus.name = t == 1 ? name : name + "@" + to_string(t);
+            bench_corpus(corpus);
+        }
+    }
+    return 0;
+}
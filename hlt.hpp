@@ -20,8 +20,11 @@ namespace hlt{
     struct Location{
         unsigned short x, y;
     };
+    // Lexicographic; the Cantor pairing used before overflowed unsigned int
+    // for large coordinates.
     static bool operator<(const Location& l1, const Location& l2) {
-        return ((l1.x + l1.y)*((unsigned int)l1.x + l1.y + 1) / 2) + l1.y < ((l2.x + l2.y)*((unsigned int)l2.x + l2.y + 1) / 2) + l2.y;
+        if(l1.y != l2.y) return l1.y < l2.y;
+        return l1.x < l2.x;
     }
 
     struct Site{
@@ -45,6 +48,12 @@ namespace hlt{
             height = otherMap.height;
             contents = otherMap.contents;
         }
+        GameMap& operator=(const GameMap &otherMap) {
+            width = otherMap.width;
+            height = otherMap.height;
+            contents = otherMap.contents;
+            return *this;
+        }
         GameMap(int w, int h) {
             width = w;
             height = h;
@@ -96,12 +105,26 @@ namespace hlt{
         }
     };
 
+    // What changed between two consecutive frames, filled in by the frame
+    // parser. Cells are x + width * y, in increasing order.
+    struct FrameDelta{
+        std::vector<int> ownerChanged;
+        // Cells whose strength is not what the previous frame predicts:
+        // kept if neutral, + production (capped at 255) if still owned.
+        std::vector<int> strengthChanged;
+        // Players whose last cell was lost in this frame.
+        std::vector<unsigned char> eliminated;
+        // Cells per player id in the current frame.
+        std::vector<int> territory;
+    };
+
     struct Move{
         Location loc; unsigned char dir;
     };
     static bool operator<(const Move& m1, const Move& m2) {
-        unsigned int l1Prod = ((m1.loc.x + m1.loc.y)*((unsigned int)m1.loc.x + m1.loc.y + 1) / 2) + m1.loc.y, l2Prod = ((m2.loc.x + m2.loc.y)*((unsigned int)m2.loc.x + m2.loc.y + 1) / 2) + m2.loc.y;
-        return ((l1Prod + m1.dir)*(l1Prod + m1.dir + 1) / 2) + m1.dir < ((l2Prod + m2.dir)*(l2Prod + m2.dir + 1) / 2) + m2.dir;
+        if(m1.loc < m2.loc) return true;
+        if(m2.loc < m1.loc) return false;
+        return m1.dir < m2.dir;
     }
 }
 
@@ -0,0 +1,284 @@
+#pragma once
+
+// Asynchronous debug log.
+//
+// debug()/debug2()/debug3() used to write straight to an ofstream with
+// std::endl, so every call paid for formatting and a flush in the middle of
+// the turn. Now a call only copies its arguments into a slot of a lock-free
+// ring buffer; a background thread formats the records (using the same
+// operator<< overloads as before) and writes them to zzz.log.
+//
+// The copy is by value and happens on the calling thread: a logged map or
+// vector is copied whole (and allocates), so hot paths should log sizes or
+// other summaries. C strings are copied into a Raw, since the record may be
+// formatted after the string is gone.
+//
+// Levels below LOG_LEVEL are compiled out entirely, arguments are not
+// evaluated. When the ring is full records are dropped (and counted) instead
+// of blocking the turn.
+
+#include "pretty_printing.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_OFF 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#ifndef LOG_FILE
+#define LOG_FILE "zzz.log"
+#endif
+
+#ifndef GAME_LOCAL
+#define GAME_LOCAL
+#endif
+
+
+namespace logging {
+
+// Preformatted text, printed without the quotes pretty_printing adds to
+// strings.
+struct Raw {
+    std::string s;
+};
+
+inline std::ostream& operator<<(std::ostream &out, const Raw &r) {
+    return out << r.s.c_str();
+}
+
+
+// The board a record is about, for operator<< overloads that need it (cell
+// coordinates). Records are formatted later on the writer thread, where the
+// logging thread's board is not at hand (and in host builds that thread
+// may have moved on to another game), so every record carries a copy of
+// 'board', which the overloads find through board_context() then.
+struct BoardContext {
+    int width;
+    int height;
+    int tile;
+};
+
+// Kept up to date by the bot.
+static GAME_LOCAL BoardContext board;
+// The context of the record being formatted, on the writer thread.
+static thread_local const BoardContext *formatting_board = nullptr;
+
+inline const BoardContext& board_context() {
+    return formatting_board ? *formatting_board : board;
+}
+
+
+const int SLOT_PAYLOAD = 224;
+const int NUM_SLOTS = 1 << 12;
+
+// Type-erased record. 'format' prints the payload and destroys it.
+struct Slot {
+    std::atomic<size_t> seq;
+    void (*format)(std::ostream &out, void *payload);
+    typename std::aligned_storage<SLOT_PAYLOAD, alignof(std::max_align_t)>::type
+        payload;
+};
+
+
+template<int i, int n>
+struct PrintFields {
+    template<typename Labels, typename Values>
+    static void call(std::ostream &out, const Labels &labels, const Values &values) {
+        out << labels[i] << std::get<i>(values);
+        PrintFields<i + 1, n>::call(out, labels, values);
+    }
+};
+
+template<int n>
+struct PrintFields<n, n> {
+    template<typename Labels, typename Values>
+    static void call(std::ostream &, const Labels &, const Values &) {}
+};
+
+
+template<typename... Args>
+struct Entry {
+    std::array<const char*, sizeof...(Args)> labels;
+    std::tuple<Args...> values;
+    BoardContext board;
+
+    void print(std::ostream &out) const {
+        formatting_board = &board;
+        PrintFields<0, sizeof...(Args)>::call(out, labels, values);
+        formatting_board = nullptr;
+        out << '\n';
+    }
+};
+
+// Small entries are constructed in the slot itself, large ones live on the
+// heap and the slot only holds the pointer.
+template<typename E, bool inline_ = (sizeof(E) <= SLOT_PAYLOAD)>
+struct Storage {
+    static void put(void *payload, E &&e) {
+        new (payload) E(std::move(e));
+    }
+    static void format(std::ostream &out, void *payload) {
+        E *e = static_cast<E*>(payload);
+        e->print(out);
+        e->~E();
+    }
+};
+
+template<typename E>
+struct Storage<E, false> {
+    static void put(void *payload, E &&e) {
+        *static_cast<E**>(payload) = new E(std::move(e));
+    }
+    static void format(std::ostream &out, void *payload) {
+        std::unique_ptr<E> e(*static_cast<E**>(payload));
+        e->print(out);
+    }
+};
+
+
+class Logger {
+public:
+    Logger() : out(LOG_FILE) {
+        for (size_t i = 0; i < NUM_SLOTS; i++)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        writer = std::thread([this]() { run(); });
+    }
+
+    ~Logger() {
+        stop.store(true);
+        writer.join();
+    }
+
+    // Bounded MPMC queue (Vyukov). Never blocks; returns false when full.
+    template<typename E>
+    bool push(E &&e) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots[pos & (NUM_SLOTS - 1)];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            auto dif = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+            if (dif == 0) {
+                if (enqueue_pos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        Storage<E>::put(&slot->payload, std::move(e));
+        slot->format = &Storage<E>::format;
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    bool pop_and_write() {
+        Slot &slot = slots[dequeue_pos & (NUM_SLOTS - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != dequeue_pos + 1)
+            return false;
+        slot.format(out, &slot.payload);
+        slot.seq.store(dequeue_pos + NUM_SLOTS, std::memory_order_release);
+        dequeue_pos++;
+        return true;
+    }
+
+    void run() {
+        while (true) {
+            bool stopping = stop.load();
+            bool any = false;
+            while (pop_and_write())
+                any = true;
+            size_t d = dropped.exchange(0, std::memory_order_relaxed);
+            if (d)
+                out << "<" << (int)d << " log records dropped>\n";
+            if (stopping)
+                break;
+            if (!any) {
+                out.flush();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        out.flush();
+    }
+
+    std::ofstream out;
+    Slot slots[NUM_SLOTS];
+    std::atomic<size_t> enqueue_pos {0};
+    size_t dequeue_pos = 0;  // only touched by the writer thread
+    std::atomic<size_t> dropped {0};
+    std::atomic<bool> stop {false};
+    std::thread writer;
+};
+
+static Logger& logger() {
+    static Logger instance;
+    return instance;
+}
+
+
+// What a record keeps of an argument.
+template<typename T>
+const T& stored(const T &x) {
+    return x;
+}
+
+inline Raw stored(const char *s) {
+    return Raw {s};
+}
+
+inline Raw stored(char *s) {
+    return Raw {s};
+}
+
+template<typename... Args>
+void emit(
+    const std::array<const char*, sizeof...(Args)> &labels,
+    const Args&... args) {
+    typedef Entry<typename std::decay<
+        decltype(stored(std::declval<const Args&>()))>::type...> E;
+    logger().push(E {labels, std::make_tuple(stored(args)...), board});
+}
+
+}  // namespace logging
+
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+
+#define debug(x) \
+    logging::emit({{#x " = "}}, (x))
+#define debug2(x, y) \
+    logging::emit({{#x " = ", ", " #y " = "}}, (x), (y))
+#define debug3(x, y, z) \
+    logging::emit({{#x " = ", ", " #y " = ", ", " #z " = "}}, (x), (y), (z))
+// Free-form line; the argument is formatted on the writer thread too.
+#define debug_line(x) \
+    logging::emit({{""}}, (x))
+
+#else
+
+#define debug(x) ((void)0)
+#define debug2(x, y) ((void)0)
+#define debug3(x, y, z) ((void)0)
+#define debug_line(x) ((void)0)
+
+#endif
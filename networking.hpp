@@ -10,6 +10,8 @@
 #include <sstream>
 #include <algorithm>
 #include <bitset>
+#include <chrono>
+#include <stdexcept>
 
 #ifdef _WIN32
 #include <sys/types.h>
@@ -26,9 +28,25 @@
 
 #include "hlt.hpp"
 
+#ifndef GAME_LOCAL
+#define GAME_LOCAL
+#endif
+
+namespace hlt{
+    // Input that does not follow the protocol: a truncated or malformed
+    // message, or the engine closing its end.
+    struct ProtocolError : public std::runtime_error {
+        explicit ProtocolError(const std::string & what) : std::runtime_error(what) { }
+    };
+    // The engine closed stdin, which is how every game ends.
+    struct EndOfInput : public ProtocolError {
+        EndOfInput() : ProtocolError("end of input") { }
+    };
+}
+
 namespace detail{
-    static std::vector< std::vector<unsigned char> > productions;
-    static int width, height;
+    static GAME_LOCAL std::vector< std::vector<unsigned char> > productions;
+    static GAME_LOCAL int width, height;
 
     static std::string serializeMoveSet(const std::set<hlt::Move> &moves) {
         std::ostringstream oss;
@@ -38,7 +56,11 @@ namespace detail{
 
     static void deserializeMapSize(const std::string & inputString) {
         std::stringstream iss(inputString);
-        iss >> width >> height;
+        int w = 0, h = 0;
+        iss >> w >> h;
+        if(!iss || w <= 0 || h <= 0 || w > 1024 || h > 1024) throw hlt::ProtocolError("malformed map size: " + inputString.substr(0, 32));
+        width = w;
+        height = h;
     }
 
     static void deserializeProductions(const std::string & inputString) {
@@ -49,6 +71,7 @@ namespace detail{
             a->resize(width);
             for(auto b = a->begin(); b != a->end(); b++) {
                 iss >> temp;
+                if(!iss || temp < 0 || temp > 255) throw hlt::ProtocolError("truncated or malformed productions");
                 *b = temp;
             }
         }
@@ -68,9 +91,13 @@ namespace detail{
 
         //Run-length encode of owners
         unsigned short y = 0, x = 0;
-        unsigned short counter = 0, owner = 0;
+        int counter = 0, owner = 0;
+        int remaining = map.width * map.height;
         while(y != map.height) {
-            for(iss >> counter >> owner; counter; counter--) {
+            iss >> counter >> owner;
+            if(!iss || counter <= 0 || counter > remaining || owner < 0 || owner > 255) throw hlt::ProtocolError("truncated or malformed owners");
+            remaining -= counter;
+            for(; counter; counter--) {
                 map.contents[y][x].owner = owner;
                 x++;
                 if(x == map.width) {
@@ -84,39 +111,128 @@ namespace detail{
             for (int b = 0; b < map.contents[a].size(); b++) {
                 short strengthShort;
                 iss >> strengthShort;
+                if(!iss || strengthShort < 0 || strengthShort > 255) throw hlt::ProtocolError("truncated or malformed strengths");
                 map.contents[a][b].strength = strengthShort;
             }
         }
 
         return map;
     }
+
+    // Parses a frame over the previous one in 'map' and records in 'delta'
+    // how they differ, in the same pass. The first owner-changed cell not
+    // yet passed by the strength loop tells it whether a cell kept its
+    // owner.
+    static void deserializeMap(const std::string & inputString, hlt::GameMap & map, hlt::FrameDelta & delta) {
+        if(map.width != width || map.height != height) {
+            map = hlt::GameMap(width, height);
+            for(int a = 0; a < map.height; a++) {
+                for(int b = 0; b < map.width; b++) {
+                    map.contents[a][b].production = productions[a][b];
+                }
+            }
+            delta.territory.clear();
+        }
+        std::stringstream iss(inputString);
+        delta.ownerChanged.clear();
+        delta.strengthChanged.clear();
+        delta.eliminated.clear();
+        std::vector<int> territory(delta.territory.size(), 0);
+
+        unsigned short y = 0, x = 0;
+        int counter = 0, owner = 0;
+        int index = 0;
+        while(y != map.height) {
+            iss >> counter >> owner;
+            if(!iss || counter <= 0 || counter > map.width * map.height - index || owner < 0 || owner > 255) throw hlt::ProtocolError("truncated or malformed owners");
+            if((size_t)owner >= territory.size()) territory.resize(owner + 1, 0);
+            territory[owner] += counter;
+            for(; counter; counter--) {
+                hlt::Site & site = map.contents[y][x];
+                if(site.owner != owner) delta.ownerChanged.push_back(index);
+                site.owner = owner;
+                index++;
+                x++;
+                if(x == map.width) {
+                    x = 0;
+                    y++;
+                }
+            }
+        }
+
+        auto changed = delta.ownerChanged.begin();
+        index = 0;
+        for(int a = 0; a < map.height; a++) {
+            for(int b = 0; b < map.width; b++, index++) {
+                hlt::Site & site = map.contents[a][b];
+                short strengthShort;
+                iss >> strengthShort;
+                if(!iss || strengthShort < 0 || strengthShort > 255) throw hlt::ProtocolError("truncated or malformed strengths");
+                int expected = site.strength;
+                if(changed != delta.ownerChanged.end() && *changed == index) changed++;
+                else if(site.owner) expected = std::min(255, expected + site.production);
+                if(strengthShort != expected) delta.strengthChanged.push_back(index);
+                site.strength = strengthShort;
+            }
+        }
+
+        for(size_t p = 0; p < delta.territory.size(); p++) {
+            if(delta.territory[p] && !territory[p]) delta.eliminated.push_back(p);
+        }
+        delta.territory.swap(territory);
+    }
+
     static void sendString(const std::string & sendString) {
         if(sendString.length() < 1) std::cout << ' ' << std::endl; //Automatically flushes.
         else std::cout << sendString.c_str() << std::endl; //Automatically flushes.
+        if(!std::cout) throw hlt::ProtocolError("engine closed its input");
     }
 
+    // When the last line was received, and optionally a capture of every
+    // line received, each prefixed with the microseconds since captureStart
+    // and a tab.
+    static std::chrono::steady_clock::time_point lastArrival;
+    static std::ostream *capture = nullptr;
+    static std::chrono::steady_clock::time_point captureStart;
+
+    // Throws hlt::EndOfInput at the end of the game instead of returning
+    // empty lines forever.
     static std::string getString() {
         std::string newString;
-        std::getline(std::cin, newString);
+        if(!std::getline(std::cin, newString)) throw hlt::EndOfInput();
+        lastArrival = std::chrono::steady_clock::now();
+        if(capture) {
+            *capture << std::chrono::duration_cast<std::chrono::microseconds>(
+                lastArrival - captureStart).count() << '\t' << newString.c_str() << std::endl;
+        }
         return newString;
     }
 }
 
-static void getInit(unsigned char& playerTag, hlt::GameMap& m) {
-    playerTag = (unsigned char)std::stoi(detail::getString());
+static inline void getInit(unsigned char& playerTag, hlt::GameMap& m) {
+    std::stringstream tag(detail::getString());
+    int t = 0;
+    if(!(tag >> t) || t <= 0 || t > 255) throw hlt::ProtocolError("malformed player tag");
+    playerTag = (unsigned char)t;
     detail::deserializeMapSize(detail::getString());
     detail::deserializeProductions(detail::getString());
     m = detail::deserializeMap(detail::getString());
 
 }
 
-static void sendInit(std::string name) {
+static inline void sendInit(std::string name) {
     detail::sendString(name);
 }
 
-static void getFrame(hlt::GameMap& m) {
+static inline void getFrame(hlt::GameMap& m) {
     m = detail::deserializeMap(detail::getString());
 }
+
+// Parses the frame over the previous one in m, see detail::deserializeMap.
+static inline void getFrame(hlt::GameMap& m, hlt::FrameDelta& delta) {
+    detail::deserializeMap(detail::getString(), m, delta);
+}
+
 static void sendFrame(const std::set<hlt::Move> &moves) {
     detail::sendString(detail::serializeMoveSet(moves));
 }
@@ -0,0 +1,5 @@
+#!/bin/bash
+set -e
+
+g++ -std=c++11 -O2 -pthread bench.cpp -o bench.o
+./bench.o "$@" bench_frames/*.txt
@@ -1,3 +1,3 @@
-g++ -std=c++11 MyBot.cpp -o MyBot.exe
+g++ -std=c++11 -pthread MyBot.cpp -o MyBot.exe
 g++ -std=c++11 RandomBot.cpp -o RandomBot.exe
 .\halite.exe -d "30 30" "MyBot.exe" "RandomBot.exe"
@@ -0,0 +1,194 @@
+#!python3
+"""SPSA self-play tuner for the constants in MyBot.cpp's Params.
+
+    g++ -std=c++11 -O2 -pthread MyBot.cpp -o MyBot.o
+    python3 tune.py --bot ./MyBot.o --opponent ./RandomBot.o \\
+        --opponent ./old/MyBot.o --games 200 --jobs 16 --iterations 50
+
+Each iteration perturbs all parameters at once in a random +-1 direction
+and plays the same seeded games with theta + c*delta and theta - c*delta
+(common random numbers), in parallel. The objective is the mean
+placement score of the candidate (1 for first, 0 for last) minus
+--cost-weight times its mean milliseconds per turn, so strength and speed
+are tuned together. Every evaluation reports both.
+
+Games are run with the Halite environment in quiet mode
+("halite -q -d 'W H' -s seed bot..."), each in its own temporary
+directory, and the candidate records its turn times with timing=<file>.
+"""
+
+import argparse
+import os
+import random
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+from concurrent.futures import ThreadPoolExecutor
+
+# name: (default, low, high, perturbation). layout_tile is left out: it
+# only changes the memory layout, not the moves, so it is measured with
+# bench -t (and can still be set as layout_tile=N on the command line).
+PARAMS = {
+    'reinforce_threshold': (6, 1, 20, 1),
+    'reinforce_target': (128, 0, 255, 16),
+    'production_weight': (1, 0, 8, 1),
+    'production_weight_experiment': (3, 0, 8, 1),
+    'combat_radius': (2, 1, 4, 1),
+    'combat_radius_experiment': (3, 2, 4, 1),
+    'combat_passes': (3, 1, 6, 1),
+    'descent_steps': (3, 1, 6, 1),
+    'rm_iterations_min': (20, 0, 40, 4),
+    'rm_iterations_max': (25, 0, 40, 4),
+    'rm_target_gap': (1, 0, 8, 1),
+    'rm_budget_ms': (300, 50, 800, 50),
+    'potential_percent': (0, 0, 200, 20),
+    'capture_blocks': (64, 4, 256, 16),
+}
+
+
+def to_params(theta):
+    """Rounds and clamps a point of the search space to valid parameters."""
+    result = {}
+    for name, (_, low, high, _) in PARAMS.items():
+        result[name] = min(high, max(low, int(round(theta[name]))))
+    result['rm_iterations_max'] = max(
+        result['rm_iterations_max'], result['rm_iterations_min'])
+    return result
+
+
+def parse_ranks(output, num_players):
+    """Player id -> rank from the environment's quiet output."""
+    ranks = {}
+    for line in output.splitlines():
+        tokens = line.split()
+        if len(tokens) >= 2 and all(t.isdigit() for t in tokens[:2]):
+            player, rank = int(tokens[0]), int(tokens[1])
+            if 1 <= player <= num_players and 1 <= rank <= num_players:
+                ranks[player] = rank
+    if len(ranks) != num_players:
+        raise RuntimeError('unexpected environment output:\n' + output)
+    return ranks
+
+
+def resolve(command):
+    """Makes the executable of a command absolute, games run elsewhere."""
+    words = shlex.split(command)
+    if os.path.exists(words[0]):
+        words[0] = os.path.abspath(words[0])
+    return ' '.join(shlex.quote(w) for w in words)
+
+
+def play(args, seed, params):
+    """One game; returns (placement score, turn times in ms)."""
+    rnd = random.Random(seed)
+    size = rnd.choice(args.sizes)
+    opponents = rnd.sample(args.opponent, min(len(args.opponent),
+                                              args.players - 1))
+    while len(opponents) < args.players - 1:
+        opponents.append(rnd.choice(args.opponent))
+    position = rnd.randrange(args.players)
+
+    workdir = tempfile.mkdtemp(prefix='tune')
+    try:
+        timing_file = os.path.join(workdir, 'timing.txt')
+        bot = [os.path.abspath(args.bot)] + args.bot_args + [
+            '%s=%d' % kv for kv in sorted(params.items())] + [
+            'timing=' + timing_file]
+        bots = [resolve(o) for o in opponents]
+        bots.insert(position, ' '.join(shlex.quote(b) for b in bot))
+        cmd = [os.path.abspath(args.engine), '-q', '-d', '%d %d' % size,
+               '-s', str(seed)] + bots
+        output = subprocess.run(
+            cmd, cwd=workdir, stdout=subprocess.PIPE,
+            stderr=subprocess.DEVNULL, universal_newlines=True).stdout
+        rank = parse_ranks(output, args.players)[position + 1]
+        with open(timing_file) as fin:
+            times = [int(line) / 1000.0 for line in fin if line.strip()]
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+    return (args.players - rank) / (args.players - 1), times
+
+
+def evaluate(args, pool, seeds, params):
+    """Objective, mean score and mean ms per turn over the given seeds."""
+    results = list(pool.map(lambda s: play(args, s, params), seeds))
+    score = sum(r[0] for r in results) / len(results)
+    times = [t for r in results for t in r[1]]
+    cost = sum(times) / max(1, len(times))
+    return score - args.cost_weight * cost, score, cost
+
+
+def main():
+    ap = argparse.ArgumentParser(
+        description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument('--engine', default='./halite')
+    ap.add_argument('--bot', default='./MyBot.o')
+    ap.add_argument('--bot-args', default='',
+                    help='extra arguments for the bot, e.g. "experiment"')
+    ap.add_argument('--opponent', action='append', default=[],
+                    help='opponent command, repeatable')
+    ap.add_argument('--players', type=int, default=2)
+    ap.add_argument('--sizes', default='20,25,30,35,40,50',
+                    help='square map sizes to draw from')
+    ap.add_argument('--games', type=int, default=100,
+                    help='games per evaluation')
+    ap.add_argument('--jobs', type=int, default=os.cpu_count())
+    ap.add_argument('--iterations', type=int, default=20)
+    ap.add_argument('--seed', type=int, default=1)
+    ap.add_argument('--cost-weight', type=float, default=0.001,
+                    help='objective units per ms per turn')
+    ap.add_argument('-a', type=float, default=2.0, help='SPSA step size')
+    ap.add_argument('-c', type=float, default=1.0,
+                    help='SPSA perturbation size, in units of each '
+                         'parameter\'s perturbation')
+    args = ap.parse_args()
+    if not args.opponent:
+        args.opponent = ['./RandomBot.o']
+    args.bot_args = args.bot_args.split()
+    args.sizes = [(int(s), int(s)) for s in args.sizes.split(',')]
+    if args.players < 2:
+        ap.error('need at least 2 players')
+
+    rnd = random.Random(args.seed)
+    theta = {name: float(p[0]) for name, p in PARAMS.items()}
+    with ThreadPoolExecutor(args.jobs) as pool:
+        seeds = [rnd.randrange(1 << 30) for _ in range(args.games)]
+        f, score, cost = evaluate(args, pool, seeds, to_params(theta))
+        print('start  objective %.4f  score %.3f  %.2f ms/turn' %
+              (f, score, cost))
+
+        for k in range(args.iterations):
+            ak = args.a / (k + 1 + args.iterations / 10.0) ** 0.602
+            ck = args.c / (k + 1) ** 0.101
+            delta = {name: rnd.choice((-1, 1)) for name in PARAMS}
+            plus = {name: theta[name] + ck * delta[name] * PARAMS[name][3]
+                    for name in PARAMS}
+            minus = {name: theta[name] - ck * delta[name] * PARAMS[name][3]
+                     for name in PARAMS}
+            seeds = [rnd.randrange(1 << 30) for _ in range(args.games)]
+            f_plus, score_plus, cost_plus = evaluate(
+                args, pool, seeds, to_params(plus))
+            f_minus, score_minus, cost_minus = evaluate(
+                args, pool, seeds, to_params(minus))
+
+            # Gradient ascent, scaled so each parameter moves in units of
+            # its own perturbation.
+            for name, (_, low, high, step) in PARAMS.items():
+                g = (f_plus - f_minus) / (2 * ck * delta[name])
+                theta[name] = min(high, max(low, theta[name] +
+                                            ak * g * step))
+
+            print('iter %3d  +: %.4f (score %.3f, %.2f ms/turn)  '
+                  '-: %.4f (score %.3f, %.2f ms/turn)' %
+                  (k, f_plus, score_plus, cost_plus,
+                   f_minus, score_minus, cost_minus))
+            print('          ' + ' '.join(
+                '%s=%d' % kv for kv in sorted(to_params(theta).items())))
+            sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    main()